@@ -0,0 +1,10 @@
+#!/usr/bin/env sh
+
+PCIE_DIR=../../pcie
+
+gcc -Wall -Wstrict-aliasing=0 -O2 -DCONFIG_DEBUG=0 \
+-I. -I$PCIE_DIR \
+-o main_bench \
+main_bench.c \
+$PCIE_DIR/pcie.c $PCIE_DIR/pcie_net.c \
+-lpthread
@@ -0,0 +1,241 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include "pcie.h"
+
+/* transport benchmark device, driven by the sw/ runner
+
+   bar[0] 32 bits registers:
+   0. BENCH_REG_SCRATCH
+   1. BENCH_REG_SINK
+   2. BENCH_REG_COUNT
+   3. BENCH_REG_ADL
+   4. BENCH_REG_ADH
+   5. BENCH_REG_SIZE
+   6. BENCH_REG_NUM
+   7. BENCH_REG_CTL
+   8. BENCH_REG_STA
+
+   operating theory:
+   BENCH_REG_SCRATCH is a plain read write register, the target of the
+   read latency scenarios.
+   each write to BENCH_REG_SINK, whatever its width, is counted and the
+   value dropped. BENCH_REG_COUNT reads the count, from any lane.
+   when BENCH_REG_CTL[31] is set, the engine writes BENCH_REG_NUM times
+   BENCH_REG_SIZE bytes to the host address formed by BENCH_REG_ADH and
+   BENCH_REG_ADL, the same range each time. the runtime splits them in
+   max payload size TLPs, as programmed by the host in the PCIe device
+   control register. a MSI is sent once all the data are written.
+   when BENCH_REG_CTL[30] is set, the engine sends BENCH_REG_NUM MSIs
+   back to back.
+   BENCH_REG_STA[31] is cleared when a run starts, and set before its
+   last MSI is sent.
+
+   BENCH_LANES in the environment is the count of lanes accepted, 8 by
+   default.
+*/
+
+typedef struct bench
+{
+  pcie_dev_t dev;
+
+  /* device registers */
+#define BENCH_REG_SCRATCH 0
+#define BENCH_REG_SINK 1
+#define BENCH_REG_COUNT 2
+#define BENCH_REG_ADL 3
+#define BENCH_REG_ADH 4
+#define BENCH_REG_SIZE 5
+#define BENCH_REG_NUM 6
+#define BENCH_REG_CTL 7
+#define BENCH_REG_STA 8
+#define BENCH_REG_MAX 9
+  uint32_t regs[BENCH_REG_MAX];
+  pcie_regmap_t regmap;
+
+  /* sink writes, from the loop and lane threads */
+  uint32_t sink_count;
+
+  /* engine source buffer, BENCH_REG_SIZE is capped to its size */
+#define BENCH_BUF_SIZE (1024 * 1024)
+  uint8_t* buf;
+
+  /* context of the run, captured at start */
+  uint32_t saved_ctl;
+  uint32_t saved_num;
+  uint32_t saved_size;
+  uint64_t saved_addr;
+
+} bench_t;
+
+#define BENCH_REG_ADDR(__r) ((BENCH_REG_ ## __r) * sizeof(uint32_t))
+
+#ifndef CONFIG_DEBUG
+#define CONFIG_DEBUG 1
+#endif
+#if CONFIG_DEBUG
+#include <stdio.h>
+#define PRINTF(__s, ...) \
+do { printf(__s, ## __VA_ARGS__); } while (0)
+#define PERROR() printf("[!] %d\n", __LINE__)
+#else
+#define PRINTF(__s, ...)
+#define PERROR()
+#endif
+
+static void run_dma(bench_t* bench)
+{
+  pcie_dev_t* const dev = &bench->dev;
+  struct iovec iov;
+  uint32_t i;
+
+  iov.iov_base = bench->buf;
+  iov.iov_len = bench->saved_size;
+
+  for (i = 0; i != bench->saved_num; ++i)
+  {
+    if (pcie_dma_write(dev, bench->saved_addr, &iov, 1, 0))
+    {
+      PERROR();
+      break ;
+    }
+  }
+
+  bench->regs[BENCH_REG_STA] = (uint32_t)1 << 31;
+
+  if (pcie_send_msi(dev)) PERROR();
+}
+
+static void run_msi(bench_t* bench)
+{
+  pcie_dev_t* const dev = &bench->dev;
+  uint32_t i;
+
+  for (i = 0; i != bench->saved_num; ++i)
+  {
+    if ((i + 1) == bench->saved_num)
+      bench->regs[BENCH_REG_STA] = (uint32_t)1 << 31;
+
+    if (pcie_send_msi(dev))
+    {
+      PERROR();
+      break ;
+    }
+  }
+}
+
+static void start_run(void* opak)
+{
+  bench_t* const bench = (bench_t*)opak;
+
+  if (bench->saved_ctl & (1 << 31)) run_dma(bench);
+  else run_msi(bench);
+}
+
+static void on_write_sink(unsigned int i, uint32_t r, void* opak)
+{
+  bench_t* const bench = (bench_t*)opak;
+  __sync_fetch_and_add(&bench->sink_count, 1);
+}
+
+static uint32_t on_read_count(unsigned int i, void* opak)
+{
+  bench_t* const bench = (bench_t*)opak;
+  return __sync_fetch_and_add(&bench->sink_count, 0);
+}
+
+static void on_write_ctl(unsigned int i, uint32_t r, void* opak)
+{
+  bench_t* const bench = (bench_t*)opak;
+  pcie_dev_t* const dev = &bench->dev;
+
+  if ((r & ((1 << 31) | (1 << 30))) == 0) return ;
+
+  /* capture context */
+  bench->saved_ctl = r;
+  bench->saved_num = bench->regs[BENCH_REG_NUM];
+  bench->saved_size = bench->regs[BENCH_REG_SIZE];
+  if (bench->saved_size > BENCH_BUF_SIZE) bench->saved_size = BENCH_BUF_SIZE;
+  bench->saved_addr =
+    ((uint64_t)bench->regs[BENCH_REG_ADH] << 32) |
+    (uint64_t)bench->regs[BENCH_REG_ADL];
+
+  bench->regs[BENCH_REG_STA] = 0;
+
+  /* run from the loop, not from the host write handler */
+  pcie_add_task(dev, 0, start_run, bench);
+}
+
+/* register map, served by the pcie runtime */
+
+static const pcie_reg_t bench_regs[] =
+{
+  PCIE_REG(BENCH_REG_ADDR(SCRATCH), PCIE_REG_RW, 0),
+  PCIE_REG_HOOK(BENCH_REG_ADDR(SINK), PCIE_REG_ACTION, 0, NULL, on_write_sink),
+  PCIE_REG_HOOK(BENCH_REG_ADDR(COUNT), PCIE_REG_RO, 0, on_read_count, NULL),
+  PCIE_REG(BENCH_REG_ADDR(ADL), PCIE_REG_RW, 0),
+  PCIE_REG(BENCH_REG_ADDR(ADH), PCIE_REG_RW, 0),
+  PCIE_REG(BENCH_REG_ADDR(SIZE), PCIE_REG_RW, 0),
+  PCIE_REG(BENCH_REG_ADDR(NUM), PCIE_REG_RW, 0),
+  PCIE_REG_HOOK(BENCH_REG_ADDR(CTL), PCIE_REG_ACTION, 0, NULL, on_write_ctl),
+  PCIE_REG(BENCH_REG_ADDR(STA), PCIE_REG_RO, 0)
+};
+
+
+/* device entry point */
+
+int main(int ac, char** av)
+{
+  const char* const laddr = av[1];
+  const char* const lport = av[2];
+  const char* const raddr = av[3];
+  const char* const rport = av[4];
+
+  size_t nlanes = 8;
+  const char* s;
+  unsigned int i;
+  int err = -1;
+
+  bench_t bench;
+
+  if (ac < 5)
+  {
+    printf("usage: %s laddr lport raddr rport\n", av[0]);
+    return -1;
+  }
+
+  if ((s = getenv("BENCH_LANES")) != NULL) nlanes = strtoul(s, NULL, 10);
+
+  bench.sink_count = 0;
+  bench.buf = malloc(BENCH_BUF_SIZE);
+  if (bench.buf == NULL) return -1;
+  for (i = 0; i < BENCH_BUF_SIZE; ++i) bench.buf[i] = (uint8_t)i;
+
+  if (pcie_init_net(&bench.dev, laddr, lport, raddr, rport) == -1)
+    goto on_error_buf;
+
+  pcie_set_vendorid(&bench.dev, 0x2a2a);
+  pcie_set_deviceid(&bench.dev, 0x2b2c);
+
+  if (pcie_init_regmap
+      (&bench.regmap, bench.regs, BENCH_REG_MAX,
+       bench_regs, sizeof(bench_regs) / sizeof(bench_regs[0]), &bench))
+    goto on_error_dev;
+
+  pcie_set_bar_regmap(&bench.dev, 0, 0x100, &bench.regmap);
+
+  if (nlanes) pcie_set_lanes(&bench.dev, nlanes);
+
+  pcie_loop(&bench.dev);
+
+  pcie_fini_regmap(&bench.regmap);
+  err = 0;
+
+ on_error_dev:
+  pcie_fini(&bench.dev);
+ on_error_buf:
+  free(bench.buf);
+  return err;
+}
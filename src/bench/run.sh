@@ -0,0 +1,31 @@
+#!/usr/bin/env sh
+
+# run the scenarios over each transport, one json line per run. build
+# hw/ and sw/ first. the runner options (-n -s -p -c -x) are passed along,
+# for instance: ./run.sh -n 10000 -s 8 -p 256
+
+HW=./hw/main_bench
+SW=./sw/bench
+PORT=42425
+SOCK=unix:/tmp/main_bench.sock
+
+run() {
+    laddr=$1
+    shift
+    $HW $laddr $PORT 127.0.0.1 42424 > /dev/null 2>&1 &
+    pid=$!
+    sleep 1
+    $SW $laddr $PORT "$@"
+    kill $pid
+    wait $pid 2> /dev/null
+}
+
+for t in 127.0.0.1 $SOCK; do
+    # main connection
+    run $t "$@" all
+    # lanes
+    run $t "$@" -c 4 mmio_read write_flood
+done
+
+# dma to memory shared with the device
+run $SOCK "$@" -m dma_write
@@ -0,0 +1,11 @@
+#!/usr/bin/env sh
+
+PCIE_DIR=../../pcie
+HOST_DIR=../../host
+
+gcc -Wall -Wstrict-aliasing=0 -O2 \
+-I. -I$HOST_DIR -I$PCIE_DIR \
+-o bench \
+main.c \
+$HOST_DIR/pcie_host.c \
+-lpthread
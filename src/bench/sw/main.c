@@ -0,0 +1,630 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pcie_host.h"
+
+
+/* transport benchmark runner, against hw/main_bench. each scenario
+   prints one json line, so that runs can be collected and compared:
+
+   {"scenario":"mmio_read","transport":"tcp","lanes":0,"shm":0,
+    "size":4,"concurrency":1,"ops":100000,"ns":...,
+    "p50_ns":...,"p99_ns":...,"p999_ns":...,"mops":...,"gbps":...}
+
+   scenarios, and what an op and its latency are:
+   config_read: a 4 bytes config read, the reply round trip.
+   mmio_read: a size bytes bar read, the reply round trip. with a
+     concurrency above 1, one lane and one thread per reader.
+   write_flood: a size bytes posted bar write, the send. the run ends
+     when the device counted them all. concurrency as mmio_read.
+   dma_write: a device transfer of xfer bytes (up to 1MB), in mps
+     bytes TLPs (the programmed max payload size, reported as size).
+     a run is concurrency transfers, written one after the other by the
+     device to the same host range, followed by a single msi. the
+     latency is the time from the start of a run to its msi.
+   msi: a device msi, the time since the previous one.
+ */
+
+
+/* device registers, refer to hw/main_bench.c */
+#define BENCH_BAR 0
+#define BENCH_REG_SCRATCH 0x00
+#define BENCH_REG_SINK 0x04
+#define BENCH_REG_COUNT 0x08
+#define BENCH_REG_ADL 0x0c
+#define BENCH_REG_ADH 0x10
+#define BENCH_REG_SIZE 0x14
+#define BENCH_REG_NUM 0x18
+#define BENCH_REG_CTL 0x1c
+#define BENCH_REG_CTL_DMA (1 << 31)
+#define BENCH_REG_CTL_MSI (1 << 30)
+#define BENCH_REG_STA 0x20
+
+/* pci express capability, to program the max payload size */
+#define CONFIG_CAP_PTR 0x34
+#define CONFIG_CAP_ID_EXP 0x10
+#define CONFIG_EXP_DEVCTL 0x08
+#define CONFIG_EXP_DEVCTL_PAYLOAD 0x00e0
+
+/* host buffer the device writes to, and its largest transfer */
+#define DMA_ADDR 0x100000000ULL
+#define DMA_MAX_XFER (1024 * 1024)
+
+#define WARMUP_OPS 1000
+#define WAIT_USECS 10000000
+#define LANE_COUNT PCIE_NET_LANE_COUNT
+
+
+typedef struct worker
+{
+  struct bench* bench;
+  pcie_host_lane_t lane;
+  pthread_t thread;
+  unsigned int is_write;
+  /* latencies of this worker */
+  uint64_t* lat;
+  size_t n;
+  int err;
+} worker_t;
+
+typedef struct bench
+{
+  pcie_host_t host;
+  const char* addr;
+  const char* port;
+
+  /* run parameters */
+  size_t ops;
+  size_t size;
+  size_t mps;
+  size_t concurrency;
+  size_t xfer;
+  unsigned int do_map;
+
+  /* opened on first use, kept for the next scenarios */
+  worker_t workers[LANE_COUNT];
+  size_t lane_count;
+  volatile size_t done_count;
+
+  /* op latencies, in ns */
+  uint64_t* lat;
+  size_t lat_count;
+
+  /* msi arrival times */
+  uint64_t msi_prev;
+} bench_t;
+
+
+static int cmp_u64(const void* a, const void* b)
+{
+  const uint64_t x = *(const uint64_t*)a;
+  const uint64_t y = *(const uint64_t*)b;
+  return (x < y) ? -1 : (x > y);
+}
+
+static uint64_t get_percentile(const uint64_t* lat, size_t n, double q)
+{
+  if (n == 0) return 0;
+  return lat[(size_t)(q * (double)(n - 1) + 0.5)];
+}
+
+static void report
+(
+ bench_t* b, const char* scenario,
+ size_t size, size_t concurrency, uint64_t bytes, uint64_t ns
+)
+{
+  const char* const transport =
+    (strncmp(b->addr, PCIE_NET_UNIX_PREFIX, strlen(PCIE_NET_UNIX_PREFIX)) == 0) ?
+    "unix" : "tcp";
+  const double dns = ns ? (double)ns : 1.0;
+
+  qsort(b->lat, b->lat_count, sizeof(uint64_t), cmp_u64);
+
+  printf
+  (
+   "{\"scenario\":\"%s\",\"transport\":\"%s\",\"lanes\":%zu,\"shm\":%u,"
+   "\"size\":%zu,\"concurrency\":%zu,\"ops\":%zu,\"ns\":%llu,"
+   "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+   "\"mops\":%.6f,\"gbps\":%.6f}\n",
+   scenario, transport, b->lane_count, b->do_map,
+   size, concurrency, b->lat_count, (unsigned long long)ns,
+   (unsigned long long)get_percentile(b->lat, b->lat_count, 0.50),
+   (unsigned long long)get_percentile(b->lat, b->lat_count, 0.99),
+   (unsigned long long)get_percentile(b->lat, b->lat_count, 0.999),
+   (double)b->lat_count * 1000.0 / dns,
+   (double)bytes / dns
+  );
+
+  fflush(stdout);
+}
+
+
+/* lanes */
+
+static void* worker_main(void* p)
+{
+  worker_t* const w = (worker_t*)p;
+  bench_t* const b = w->bench;
+  uint64_t x;
+  size_t i;
+
+  for (i = 0; i != w->n; ++i)
+  {
+    const uint64_t t = pcie_host_get_ns();
+
+    if (w->is_write)
+    {
+      w->err = pcie_host_lane_write_mem
+	(&w->lane, BENCH_BAR, BENCH_REG_SINK, b->size, i);
+    }
+    else
+    {
+      w->err = pcie_host_lane_read_mem
+	(&w->lane, BENCH_BAR, BENCH_REG_SCRATCH, b->size, &x);
+    }
+
+    w->lat[i] = pcie_host_get_ns() - t;
+    if (w->err) break ;
+  }
+
+  __sync_fetch_and_add(&b->done_count, 1);
+
+  return NULL;
+}
+
+static int open_lanes(bench_t* b, size_t n)
+{
+  if (n > LANE_COUNT) n = LANE_COUNT;
+
+  for (; b->lane_count < n; ++b->lane_count)
+  {
+    worker_t* const w = &b->workers[b->lane_count];
+    w->bench = b;
+    if (pcie_host_open_lane
+	(&b->host, &w->lane, b->addr, b->port, (unsigned int)b->lane_count))
+      return -1;
+  }
+
+  return 0;
+}
+
+static void close_lanes(bench_t* b)
+{
+  size_t i;
+  for (i = 0; i != b->lane_count; ++i)
+    pcie_host_close_lane(&b->workers[i].lane);
+  b->lane_count = 0;
+}
+
+static int run_workers(bench_t* b, unsigned int is_write)
+{
+  /* ops split among concurrency lanes. the main connection is served
+     meanwhile, lane reads wait for it.
+   */
+
+  const size_t n = b->concurrency;
+  size_t off = 0;
+  int err = 0;
+  size_t i;
+
+  if (open_lanes(b, n)) return -1;
+
+  b->done_count = 0;
+
+  for (i = 0; i != n; ++i)
+  {
+    worker_t* const w = &b->workers[i];
+    w->is_write = is_write;
+    w->n = b->ops / n + ((i < (b->ops % n)) ? 1 : 0);
+    w->lat = b->lat + off;
+    w->err = 0;
+    off += w->n;
+    if (pthread_create(&w->thread, NULL, worker_main, w))
+    {
+      b->concurrency = i;
+      err = -1;
+      break ;
+    }
+  }
+
+  while (b->done_count != b->concurrency)
+  {
+    if (pcie_host_poll(&b->host, 1000)) { err = -1; break ; }
+  }
+
+  for (i = 0; i != b->concurrency; ++i)
+  {
+    pthread_join(b->workers[i].thread, NULL);
+    if (b->workers[i].err) err = -1;
+  }
+
+  b->concurrency = n;
+
+  return err;
+}
+
+
+/* scenarios */
+
+static int bench_config_read(bench_t* b)
+{
+  pcie_host_t* const h = &b->host;
+  uint64_t x;
+  uint64_t t;
+  size_t i;
+
+  for (i = 0; i != WARMUP_OPS; ++i)
+    if (pcie_host_read_config(h, 0, 4, &x)) return -1;
+
+  t = pcie_host_get_ns();
+
+  for (i = 0; i != b->ops; ++i)
+  {
+    const uint64_t tt = pcie_host_get_ns();
+    if (pcie_host_read_config(h, 0, 4, &x)) return -1;
+    b->lat[i] = pcie_host_get_ns() - tt;
+  }
+
+  t = pcie_host_get_ns() - t;
+
+  b->lat_count = b->ops;
+  report(b, "config_read", 4, 1, (uint64_t)b->ops * 4, t);
+
+  return 0;
+}
+
+static int bench_mmio_read(bench_t* b)
+{
+  pcie_host_t* const h = &b->host;
+  uint64_t x;
+  uint64_t t;
+  size_t i;
+
+  for (i = 0; i != WARMUP_OPS; ++i)
+    if (pcie_host_read_mem(h, BENCH_BAR, BENCH_REG_SCRATCH, b->size, &x))
+      return -1;
+
+  t = pcie_host_get_ns();
+
+  if (b->concurrency > 1)
+  {
+    if (run_workers(b, 0)) return -1;
+  }
+  else
+  {
+    for (i = 0; i != b->ops; ++i)
+    {
+      const uint64_t tt = pcie_host_get_ns();
+      if (pcie_host_read_mem(h, BENCH_BAR, BENCH_REG_SCRATCH, b->size, &x))
+	return -1;
+      b->lat[i] = pcie_host_get_ns() - tt;
+    }
+  }
+
+  t = pcie_host_get_ns() - t;
+
+  b->lat_count = b->ops;
+  report
+    (b, "mmio_read", b->size, b->concurrency, (uint64_t)b->ops * b->size, t);
+
+  return 0;
+}
+
+static int bench_write_flood(bench_t* b)
+{
+  pcie_host_t* const h = &b->host;
+  uint64_t count;
+  uint64_t x;
+  uint64_t t;
+  size_t i;
+
+  if (pcie_host_read_mem(h, BENCH_BAR, BENCH_REG_COUNT, 4, &count))
+    return -1;
+  count = (count + b->ops) & 0xffffffff;
+
+  t = pcie_host_get_ns();
+
+  if (b->concurrency > 1)
+  {
+    if (run_workers(b, 1)) return -1;
+  }
+  else
+  {
+    for (i = 0; i != b->ops; ++i)
+    {
+      const uint64_t tt = pcie_host_get_ns();
+      if (pcie_host_write_mem(h, BENCH_BAR, BENCH_REG_SINK, b->size, i))
+	return -1;
+      b->lat[i] = pcie_host_get_ns() - tt;
+    }
+  }
+
+  /* the writes are done once the device counted them */
+  while (1)
+  {
+    if (pcie_host_read_mem(h, BENCH_BAR, BENCH_REG_COUNT, 4, &x)) return -1;
+    if (x == count) break ;
+  }
+
+  t = pcie_host_get_ns() - t;
+
+  b->lat_count = b->ops;
+  report
+    (b, "write_flood", b->size, b->concurrency, (uint64_t)b->ops * b->size, t);
+
+  return 0;
+}
+
+static int set_mps(bench_t* b, size_t* mps)
+{
+  /* walk the capability list of the probed config image. mps is a
+     valid payload size, refer to main.
+   */
+
+  pcie_host_t* const h = &b->host;
+  unsigned int code = 0;
+  unsigned int off;
+  unsigned int n;
+  uint64_t devctl;
+
+  while ((code != 5) && ((size_t)(128 << code) < *mps)) ++code;
+  *mps = (size_t)128 << code;
+
+  off = h->config[CONFIG_CAP_PTR] & ~3;
+  for (n = 0; (off != 0) && (n != 48); ++n)
+  {
+    if (h->config[off] == CONFIG_CAP_ID_EXP) break ;
+    off = h->config[off + 1] & ~3;
+  }
+
+  if ((off == 0) || (n == 48))
+  {
+    printf("[!] no pci express capability\n");
+    return -1;
+  }
+
+  off += CONFIG_EXP_DEVCTL;
+  if (pcie_host_read_config(h, off, 2, &devctl)) return -1;
+  devctl &= ~(uint64_t)CONFIG_EXP_DEVCTL_PAYLOAD;
+  devctl |= code << 5;
+  return pcie_host_write_config(h, off, 2, devctl);
+}
+
+static int bench_dma_write(bench_t* b)
+{
+  pcie_host_t* const h = &b->host;
+  const size_t runs = (b->ops + b->concurrency - 1) / b->concurrency;
+  size_t mps = b->mps;
+  uint64_t msis;
+  uint64_t t;
+  size_t i;
+
+  if (set_mps(b, &mps)) return -1;
+
+  /* each transfer writes the same xfer bytes */
+  if (b->do_map && (h->map_count == 0))
+  {
+    if (pcie_host_map_mem(h, DMA_ADDR, b->xfer)) return -1;
+  }
+
+  if (pcie_host_write_mem(h, BENCH_BAR, BENCH_REG_ADL, 4, DMA_ADDR & 0xffffffff))
+    return -1;
+  if (pcie_host_write_mem(h, BENCH_BAR, BENCH_REG_ADH, 4, DMA_ADDR >> 32))
+    return -1;
+  if (pcie_host_write_mem(h, BENCH_BAR, BENCH_REG_SIZE, 4, b->xfer))
+    return -1;
+
+  msis = h->stats.msis;
+  t = pcie_host_get_ns();
+
+  for (i = 0; i != runs; ++i)
+  {
+    const size_t n = ((i + 1) == runs) ? (b->ops - i * b->concurrency) :
+      b->concurrency;
+    const uint64_t tt = pcie_host_get_ns();
+
+    if (pcie_host_write_mem(h, BENCH_BAR, BENCH_REG_NUM, 4, n)) return -1;
+    if (pcie_host_write_mem(h, BENCH_BAR, BENCH_REG_CTL, 4, BENCH_REG_CTL_DMA))
+      return -1;
+
+    if (pcie_host_wait_msi(h, ++msis, WAIT_USECS))
+    {
+      printf("[!] dma_write timeout\n");
+      return -1;
+    }
+
+    b->lat[i] = pcie_host_get_ns() - tt;
+  }
+
+  t = pcie_host_get_ns() - t;
+
+  b->lat_count = runs;
+  report
+    (b, "dma_write", mps, b->concurrency, (uint64_t)b->ops * b->xfer, t);
+
+  return 0;
+}
+
+static void on_msi(void* p)
+{
+  bench_t* const b = (bench_t*)p;
+  const uint64_t now = pcie_host_get_ns();
+
+  if (b->lat_count != b->ops) b->lat[b->lat_count++] = now - b->msi_prev;
+  b->msi_prev = now;
+}
+
+static int bench_msi(bench_t* b)
+{
+  pcie_host_t* const h = &b->host;
+  const uint64_t msis = h->stats.msis + b->ops;
+  uint64_t t;
+  int err;
+
+  b->lat_count = 0;
+  h->msi_fn = on_msi;
+  h->msi_data = b;
+
+  if (pcie_host_write_mem(h, BENCH_BAR, BENCH_REG_NUM, 4, b->ops)) return -1;
+
+  t = b->msi_prev = pcie_host_get_ns();
+  err = pcie_host_write_mem(h, BENCH_BAR, BENCH_REG_CTL, 4, BENCH_REG_CTL_MSI);
+  if (err == 0) err = pcie_host_wait_msi(h, msis, WAIT_USECS);
+  t = pcie_host_get_ns() - t;
+
+  h->msi_fn = NULL;
+
+  if (err)
+  {
+    printf("[!] msi timeout\n");
+    return -1;
+  }
+
+  report(b, "msi", 0, 1, 0, t);
+
+  return 0;
+}
+
+
+/* entry point */
+
+typedef struct scenario
+{
+  const char* name;
+  int (*fn)(bench_t*);
+} scenario_t;
+
+static const scenario_t scenarios[] =
+{
+  { "config_read", bench_config_read },
+  { "mmio_read", bench_mmio_read },
+  { "write_flood", bench_write_flood },
+  { "dma_write", bench_dma_write },
+  { "msi", bench_msi }
+};
+
+#define SCENARIO_COUNT (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static void usage(const char* s)
+{
+  size_t i;
+
+  printf("usage: %s addr port [options] scenario ...\n", s);
+  printf(" addr: inet address, or unix:path (port is then unused)\n");
+  printf(" options:\n");
+  printf("  -n ops          ops per scenario (100000)\n");
+  printf("  -s size         mmio access width, 1 2 4 or 8 (4)\n");
+  printf("  -p mps          dma max payload size, 128 to 4096 (128)\n");
+  printf("  -c concurrency  lanes, or dma transfers per msi (1)\n");
+  printf("  -x xfer         dma transfer size, up to 1MB (65536)\n");
+  printf("  -m              dma to memory shared with the device, unix\n");
+  printf(" scenarios: all");
+  for (i = 0; i != SCENARIO_COUNT; ++i) printf(" %s", scenarios[i].name);
+  printf("\n");
+}
+
+int main(int ac, char** av)
+{
+  bench_t b;
+  size_t i;
+  int err = -1;
+  int c;
+
+  if (ac < 4)
+  {
+    usage(av[0]);
+    return -1;
+  }
+
+  b.addr = av[1];
+  b.port = av[2];
+  b.ops = 100000;
+  b.size = 4;
+  b.mps = 128;
+  b.concurrency = 1;
+  b.xfer = 0x10000;
+  b.do_map = 0;
+  b.lane_count = 0;
+  b.lat = NULL;
+
+  optind = 3;
+  while ((c = getopt(ac, av, "n:s:p:c:x:m")) != -1)
+  {
+    switch (c)
+    {
+    case 'n': b.ops = strtoul(optarg, NULL, 0); break ;
+    case 's': b.size = strtoul(optarg, NULL, 0); break ;
+    case 'p': b.mps = strtoul(optarg, NULL, 0); break ;
+    case 'c': b.concurrency = strtoul(optarg, NULL, 0); break ;
+    case 'x': b.xfer = strtoul(optarg, NULL, 0); break ;
+    case 'm': b.do_map = 1; break ;
+    default: usage(av[0]); return -1;
+    }
+  }
+
+  if ((b.ops == 0) || (b.concurrency == 0) || (b.concurrency > LANE_COUNT))
+  {
+    printf("[!] invalid ops or concurrency\n");
+    return -1;
+  }
+
+  /* access widths of a single TLP */
+  if ((b.size == 0) || (b.size > 8) || (b.size & (b.size - 1)))
+  {
+    printf("[!] invalid size\n");
+    return -1;
+  }
+
+  /* payload sizes encodable in the device control register */
+  if ((b.mps < 128) || (b.mps > 4096) || (b.mps & (b.mps - 1)))
+  {
+    printf("[!] invalid mps\n");
+    return -1;
+  }
+
+  /* the device caps the transfers to its buffer, refer to BENCH_BUF_SIZE */
+  if ((b.xfer == 0) || (b.xfer > DMA_MAX_XFER))
+  {
+    printf("[!] invalid xfer\n");
+    return -1;
+  }
+
+  b.lat = malloc(b.ops * sizeof(uint64_t));
+  if (b.lat == NULL) return -1;
+
+  if (pcie_host_open(&b.host, b.addr, b.port, 0)) goto on_error_lat;
+  if (pcie_host_probe(&b.host, 0)) goto on_error_host;
+
+  for (; optind < ac; ++optind)
+  {
+    const unsigned int is_all = (strcmp(av[optind], "all") == 0);
+    unsigned int is_found = 0;
+
+    for (i = 0; i != SCENARIO_COUNT; ++i)
+    {
+      if (!is_all && strcmp(av[optind], scenarios[i].name)) continue ;
+      is_found = 1;
+      if (scenarios[i].fn(&b)) goto on_error_lanes;
+    }
+
+    if (is_found == 0)
+    {
+      printf("[!] invalid scenario: %s\n", av[optind]);
+      goto on_error_lanes;
+    }
+  }
+
+  err = 0;
+
+ on_error_lanes:
+  close_lanes(&b);
+ on_error_host:
+  pcie_host_close(&b.host);
+ on_error_lat:
+  free(b.lat);
+  return err;
+}
@@ -6,4 +6,5 @@ gcc -Wall -Wstrict-aliasing=0 -O2 \
 -I. -I$PCIE_DIR \
 -o main_dma \
 main_dma.c \
-$PCIE_DIR/pcie.c $PCIE_DIR/pcie_net.c
+$PCIE_DIR/pcie.c $PCIE_DIR/pcie_net.c \
+-lpthread
@@ -12,6 +12,8 @@
    2. DMA_REG_ADL
    3. DMA_REG_ADH
    4. DMA_REG_BAZ
+   5. DMA_REG_WBL
+   6. DMA_REG_WBH
 
    operating theory:
    the DMA engine is connected to an internal 32KB BRAM memory
@@ -25,8 +27,15 @@
    when DMA_REG_CTL[31] is set, the transfer starts. DMA_REG_STA[31]
    is automatically cleared when the transfer starts, and set to one
    when the transfer ends. DMA_REG_STA[15:0] is updated with the byte
-   count actually transfered.
+   count actually transfered. if the transfer fails, DMA_REG_STA[30] is
+   set instead, and neither the MSI nor the writeback occurs. a start
+   written while a transfer is in progress is latched, and runs next.
    if set to 1 DMA_REG_CTL[30], a MSI occurs when the transfer ends.
+   if set to 1 DMA_REG_CTL[29], the engine writes back its status when
+   the transfer ends, after the data and before the MSI: DMA_REG_STA
+   then the byte count, two 32 bits words at the 64 bits host address
+   formed by DMA_REG_WBH and DMA_REG_WBL. the host can spin on this
+   memory instead of reading DMA_REG_STA or waiting for the MSI.
 */
 
 typedef struct dma
@@ -39,17 +48,29 @@ typedef struct dma
 #define DMA_REG_ADL 2
 #define DMA_REG_ADH 3
 #define DMA_REG_BAZ 4
-#define DMA_REG_COUNT 5
+#define DMA_REG_WBL 5
+#define DMA_REG_WBH 6
+#define DMA_REG_COUNT 7
   uint32_t regs[DMA_REG_COUNT];
+  pcie_regmap_t regmap;
 
   /* bram (must be a multiple of page size) */
   uint8_t bram[8 * 0x1000];
+  /* engine output, in flight until the dma completes */
+  uint8_t obuf[8 * 0x1000];
+  /* status writeback, in flight until written */
+  uint32_t wbuf[2];
 
-  /* context for the dma completion callback */
+  /* latched start, 0 if none */
+  unsigned int is_busy;
+  uint32_t pending_ctl;
+
+  /* context for the dma completion callback, captured at start */
   uint32_t saved_ctl;
   uint32_t saved_adh;
   uint32_t saved_adl;
   uint32_t saved_baz;
+  uint64_t saved_wb;
 
 } dma_t;
 
@@ -68,113 +89,127 @@ do { printf(__s, ## __VA_ARGS__); } while (0)
 #define ASSERT(__x)
 #endif
 
-static void on_read(uint64_t addr, void* data, size_t size, void* opak)
+static void start_transfer(dma_t*, uint32_t);
+
+static void end_transfer(dma_t* dma)
+{
+  /* obuf is released and the writeback sent, run the latched start */
+  const uint32_t r = dma->pending_ctl;
+
+  dma->is_busy = 0;
+  dma->pending_ctl = 0;
+  if (r) start_transfer(dma, r);
+}
+
+static void on_dma_done(int err, void* opak)
 {
   dma_t* const dma = (dma_t*)opak;
 
-  PRINTF("%s (0x%lx)\n", __FUNCTION__, (unsigned long)addr);
+  /* report the error, the runtime sends no MSI and nothing is written
+     back: the host reads it from DMA_REG_STA.
+   */
+  if (err)
+  {
+    PERROR();
+    dma->regs[DMA_REG_STA] = 1 << 30;
+    end_transfer(dma);
+    return ;
+  }
+
+  /* set byte count transmited, and clar transfer in progress flag.
+     the runtime sends the MSI, if enabled, after this returns.
+   */
+  dma->regs[DMA_REG_STA] = (1 << 31) | (dma->saved_ctl & 0xffff);
 
-  switch (addr)
+  /* the writeback follows the data, and the MSI follows it */
+  if (dma->saved_ctl & (1 << 29))
   {
-  case DMA_REG_ADDR(CTL):
-  case DMA_REG_ADDR(STA):
-  case DMA_REG_ADDR(ADL):
-  case DMA_REG_ADDR(ADH):
-  case DMA_REG_ADDR(BAZ):
-    memcpy(data, (uint8_t*)dma->regs + addr, size);
-    break ;
-
-  default:
-    memset(data, 0xff, size);
-    break ;
+    dma->wbuf[0] = dma->regs[DMA_REG_STA];
+    dma->wbuf[1] = dma->saved_ctl & 0xffff;
+    if (pcie_write_mem(&dma->dev, dma->saved_wb, dma->wbuf, sizeof(dma->wbuf)))
+      PERROR();
   }
+
+  end_transfer(dma);
 }
 
 static void finalize_transfer(void* opak)
 {
-  pcie_net_msg_t* m;
   dma_t* const dma = (dma_t*)opak;
   pcie_dev_t* const dev = &dma->dev;
-  unsigned int n;
+  struct iovec iov;
+  unsigned int flags = 0;
+  uint64_t addr;
   unsigned int i;
-  unsigned int j;
-  const uint8_t* p;
-  size_t size_per_m;
 
   PRINTF("%s\n", __FUNCTION__);
 
-  /* dma writes are multiple of page size. limit to 1 page per message. */
-  ASSERT(PCIE_NET_MSG_MAX_SIZE - offsetof(pcie_net_msg_t, data));
-  ASSERT(!((PCIE_NET_MSG_MAX_SIZE - offsetof(pcie_net_msg_t, data)) % 0x1000));
-  size_per_m = 0x1000;
+  /* the engine adds baz to the bram contents. the output buffer is
+     sent as is by the runtime, split in max payload size TLPs.
+   */
+  for (i = 0; i < sizeof(dma->bram); ++i)
+    dma->obuf[i] = dma->bram[i] + (uint8_t)dma->saved_baz;
 
-  if ((m = malloc(PCIE_NET_MSG_MAX_SIZE)) == NULL) return ;
-  m->op = PCIE_NET_OP_WRITE_MEM;
-  m->addr = ((uint64_t)dma->saved_adh << 32) | (uint64_t)dma->saved_adl;
+  addr = ((uint64_t)dma->saved_adh << 32) | (uint64_t)dma->saved_adl;
+  iov.iov_base = dma->obuf;
+  iov.iov_len = sizeof(dma->obuf);
 
-  /* do the actual dma transfer */
-  n = sizeof(dma->bram) / size_per_m;
-  p = dma->bram;
-  m->size = size_per_m;
-  for (i = 0; i < n; ++i)
-  {
-    memcpy(m->data, p, size_per_m);
-    /* TODO: one pass */
-    for (j = 0; j < size_per_m; ++j) m->data[j] += (uint8_t)dma->saved_baz;
-    pcie_net_send_msg(&dev->net, m);
-    p += size_per_m;
-    m->addr += size_per_m;
-  }
+  /* send MSI if enabled */
+  if (dma->saved_ctl & (1 << 30)) flags |= PCIE_DMA_MSI;
 
-  m->size = sizeof(dma->bram) % size_per_m;
-  if (m->size)
+  if (pcie_dma_write_async(dev, addr, &iov, 1, flags, on_dma_done, dma))
   {
-    memcpy(m->data, p, m->size);
-    /* TODO: one pass */
-    for (j = 0; j < m->size; ++j) m->data[j] += (uint8_t)dma->saved_baz;
-    pcie_net_send_msg(&dev->net, m);
+    PERROR();
+    dma->regs[DMA_REG_STA] = 1 << 30;
+    end_transfer(dma);
   }
+}
 
-  free(m);
+static void start_transfer(dma_t* dma, uint32_t r)
+{
+  dma->is_busy = 1;
 
-  /* set byte count transmited, and clar transfer in progress flag. */
-  dma->regs[DMA_REG_STA] = (1 << 31) | (dma->saved_ctl & 0xffff);
+  /* capture context */
+  dma->saved_ctl = r;
+  dma->saved_adl = dma->regs[DMA_REG_ADL];
+  dma->saved_adh = dma->regs[DMA_REG_ADH];
+  dma->saved_baz = dma->regs[DMA_REG_BAZ];
+  dma->saved_wb =
+    ((uint64_t)dma->regs[DMA_REG_WBH] << 32) |
+    (uint64_t)dma->regs[DMA_REG_WBL];
 
-  /* send MSI if enabled */
-  if (dma->saved_ctl & (1 << 30)) pcie_send_msi(dev);
+  dma->regs[DMA_REG_STA] = 0;
+
+  /* simulate some delay in operation with blocking */
+  pcie_add_task(&dma->dev, 1000, finalize_transfer, dma);
 }
 
-static void on_write(uint64_t addr, const void* data, size_t size, void* opak)
+static void on_write_ctl(unsigned int i, uint32_t r, void* opak)
 {
   dma_t* const dma = (dma_t*)opak;
-  pcie_dev_t* const dev = &dma->dev;
 
-  PRINTF("%s (0x%lx)\n", __FUNCTION__, (unsigned long)addr);
+  PRINTF("%s (0x%x)\n", __FUNCTION__, r);
 
-  /* common to all registers */
-  memcpy((uint8_t*)dma->regs + addr, data, size);
+  if ((r & (1 << 31)) == 0) return ;
 
-  if (addr == DMA_REG_ADDR(CTL))
-  {
-    const uint32_t r = dma->regs[DMA_REG_CTL];
-
-    /* start transfer */
-    if (r & (1 << 31))
-    {
-      /* capture context */
-      dma->saved_ctl = r;
-      dma->saved_adl = dma->regs[DMA_REG_ADL];
-      dma->saved_adh = dma->regs[DMA_REG_ADH];
-      dma->saved_baz = dma->regs[DMA_REG_BAZ];
-
-      dma->regs[DMA_REG_STA] = 0;
-
-      /* simulate some delay in operation with blocking */
-      pcie_add_task(dev, 1000, finalize_transfer, dma);
-    }
-  }
+  /* the context is captured when the latched start runs */
+  if (dma->is_busy) dma->pending_ctl = r;
+  else start_transfer(dma, r);
 }
 
+/* register map, served by the pcie runtime */
+
+static const pcie_reg_t dma_regs[] =
+{
+  PCIE_REG_HOOK(DMA_REG_ADDR(CTL), PCIE_REG_ACTION, 0, NULL, on_write_ctl),
+  PCIE_REG(DMA_REG_ADDR(STA), PCIE_REG_RO, 0),
+  PCIE_REG(DMA_REG_ADDR(ADL), PCIE_REG_RW, 0),
+  PCIE_REG(DMA_REG_ADDR(ADH), PCIE_REG_RW, 0),
+  PCIE_REG(DMA_REG_ADDR(BAZ), PCIE_REG_RW, 0),
+  PCIE_REG(DMA_REG_ADDR(WBL), PCIE_REG_RW, 0),
+  PCIE_REG(DMA_REG_ADDR(WBH), PCIE_REG_RW, 0)
+};
+
 
 /* device entry point */
 
@@ -192,14 +227,35 @@ int main(int ac, char** av)
   /* initialize bram, increasing pattern */
   for (i = 0; i < sizeof(dma.bram); ++i) dma.bram[i] = (uint8_t)i;
 
+  dma.is_busy = 0;
+  dma.pending_ctl = 0;
+
   if (pcie_init_net(&dma.dev, laddr, lport, raddr, rport) == -1) return -1;
 
   pcie_set_vendorid(&dma.dev, 0x2a2a);
   pcie_set_deviceid(&dma.dev, 0x2b2b);
-  pcie_set_bar(&dma.dev, 1, 0x100, on_read, on_write, &dma);
+
+  if (pcie_init_regmap
+      (&dma.regmap, dma.regs, DMA_REG_COUNT,
+       dma_regs, sizeof(dma_regs) / sizeof(dma_regs[0]), &dma))
+  {
+    pcie_fini(&dma.dev);
+    return -1;
+  }
+
+  pcie_set_bar_regmap(&dma.dev, 1, 0x100, &dma.regmap);
+
+  /* addresses and baz only change when the host writes them. their
+     writes can be combined, the control register write that starts
+     the transfer is not.
+   */
+  pcie_set_bar_attr
+    (&dma.dev, 1, DMA_REG_ADDR(ADL), 5 * sizeof(uint32_t),
+     PCIE_NET_ATTR_CACHEABLE | PCIE_NET_ATTR_WC);
 
   pcie_loop(&dma.dev);
 
+  pcie_fini_regmap(&dma.regmap);
   pcie_fini(&dma.dev);
 
   return 0;
@@ -0,0 +1,13 @@
+#!/usr/bin/env sh
+
+PCIE_DIR=../../../pcie
+
+gcc -Wall -Wstrict-aliasing=0 -O2 -I$PCIE_DIR -c $PCIE_DIR/pcie.c -o pcie_c.o
+gcc -Wall -O2 -I$PCIE_DIR -c $PCIE_DIR/pcie_net.c -o pcie_net_c.o
+
+g++ -std=c++20 -Wall -O2 \
+-I. -I$PCIE_DIR \
+-o main_dma \
+main_dma.cpp \
+pcie_c.o pcie_net_c.o \
+-lpthread
@@ -0,0 +1,87 @@
+#include <cstdint>
+#include <cstdio>
+#include "vpcie.hpp"
+#include "vpcie_coro.hpp"
+
+/* simple dma engine, C++ version of d_in_c/main_dma.c.
+   refer to it for the operating theory.
+ */
+
+struct dma_ctl : vpcie::reg<0x00, vpcie::access::action> {};
+struct dma_sta : vpcie::reg<0x04, vpcie::access::ro> {};
+struct dma_adl : vpcie::reg<0x08, vpcie::access::rw> {};
+struct dma_adh : vpcie::reg<0x0c, vpcie::access::rw> {};
+struct dma_baz : vpcie::reg<0x10, vpcie::access::rw> {};
+
+typedef vpcie::regmap<dma_ctl, dma_sta, dma_adl, dma_adh, dma_baz> dma_regs;
+typedef vpcie::config<0x2a2a, 0x2b2b> dma_config;
+
+struct dma : vpcie::device<dma, dma_config, vpcie::bar<1, dma_regs, 0x100>>
+{
+  /* bram (must be a multiple of page size) */
+  uint8_t bram[8 * 0x1000];
+
+  vpcie::sched sched{ &dev() };
+
+  /* raised with DMA_REG_CTL when a transfer starts. a start written
+     while the engine is busy is latched, and runs next.
+   */
+  vpcie::event<uint32_t> start;
+
+  void on_write(dma_ctl, uint32_t r)
+  {
+    if ((r & (1 << 31)) == 0) return ;
+    reg<dma_sta>() = 0;
+    start.set(r);
+  }
+
+  vpcie::process engine()
+  {
+    uint8_t page[0x1000];
+
+    while (1)
+    {
+      /* registers are captured when the transfer starts */
+      const uint32_t ctl = co_await start;
+      uint64_t addr = ((uint64_t)reg<dma_adh>() << 32) | reg<dma_adl>();
+      const uint8_t baz = (uint8_t)reg<dma_baz>();
+
+      /* simulate some delay in operation */
+      co_await sched.sleep(1000);
+
+      /* limit to 1 page per message */
+      for (size_t i = 0; i != sizeof(bram); i += sizeof(page), addr += sizeof(page))
+      {
+	for (size_t j = 0; j != sizeof(page); ++j) page[j] = bram[i + j] + baz;
+	co_await sched.write_mem(addr, page);
+      }
+
+      /* set byte count transmited, and clear transfer in progress flag */
+      reg<dma_sta>() = (1 << 31) | (ctl & 0xffff);
+
+      /* send MSI if enabled */
+      if (ctl & (1 << 30)) send_msi();
+    }
+  }
+};
+
+
+/* device entry point */
+
+int main(int ac, char** av)
+{
+  static dma d;
+
+  if (ac < 5) return -1;
+
+  /* initialize bram, increasing pattern */
+  for (size_t i = 0; i != sizeof(d.bram); ++i) d.bram[i] = (uint8_t)i;
+
+  if (d.init_net(av[1], av[2], av[3], av[4]) == -1) return -1;
+
+  d.engine();
+  d.loop();
+  d.fini();
+
+  return 0;
+}
@@ -0,0 +1,2 @@
+#!/usr/bin/env sh
+./main_dma 127.0.0.1 42425 127.0.0.1 42424
@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <fcntl.h>
@@ -118,6 +119,9 @@ typedef struct dma_io
   /* status register at completion time */
   uint32_t sta;
 
+  /* status writeback, NULL to wait for the interrupt instead */
+  dma_buf_t* wb;
+
 } dma_io_t;
 
 
@@ -233,6 +237,8 @@ static int dma_start_read(dma_handle_t* h, dma_io_t* io, dma_buf_t* buf)
 #define DMA_REG_ADL 0x08
 #define DMA_REG_ADH 0x0c
 #define DMA_REG_BAZ 0x10
+#define DMA_REG_WBL 0x14
+#define DMA_REG_WBH 0x18
 
   uint32_t x;
 
@@ -240,8 +246,21 @@ static int dma_start_read(dma_handle_t* h, dma_io_t* io, dma_buf_t* buf)
 
   io->buf = buf;
 
-  /* clear pending interrupt */
-  pci_dev_poll_int(h->fd, &x);
+  if (io->wb != NULL)
+  {
+    /* cleared before the device writes it back */
+    memset(io->wb->vaddr, 0, 2 * sizeof(uint32_t));
+
+    x = (uint32_t)(io->wb->paddr >> 32);
+    pci_dev_write_word32(h->fd, DMA_REG_BAR, DMA_REG_WBH, x);
+    x = (uint32_t)(io->wb->paddr & 0xffffffff);
+    pci_dev_write_word32(h->fd, DMA_REG_BAR, DMA_REG_WBL, x);
+  }
+  else
+  {
+    /* clear pending interrupt */
+    pci_dev_poll_int(h->fd, &x);
+  }
 
   /* synchronize physical memory with cache hierarchy */
   dma_sync_pmem(h, buf);
@@ -255,17 +274,79 @@ static int dma_start_read(dma_handle_t* h, dma_io_t* io, dma_buf_t* buf)
   x = (uint32_t)(buf->paddr & 0xffffffff);
   pci_dev_write_word32(h->fd, DMA_REG_BAR, DMA_REG_ADL, x);
 
-  /* set size, start transfer, enable msi */
-  x = (1 << 31) | (1 << 30) | buf->size;
+  /* set size, start transfer, enable msi or status writeback */
+  x = (1 << 31) | buf->size;
+  x |= (io->wb != NULL) ? (1 << 29) : (1 << 30);
   pci_dev_write_word32(h->fd, DMA_REG_BAR, DMA_REG_CTL, x);
 
   return 0;
 }
 
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __asm__ __volatile__ ("pause" ::: "memory");
+#else
+  __asm__ __volatile__ ("" ::: "memory");
+#endif
+}
+
+static int poll_wb(dma_handle_t* h, dma_io_t* io)
+{
+  /* spin on the status written back by the device, after the data.
+     the memory stays in cache until the device write snoops it, so
+     there is neither ioctl nor interrupt on the way. a failed transfer
+     is not written back: after a while, the status register is read,
+     and the wait eventually times out.
+   */
+
+#define CONFIG_WB_SPINS 100000
+#define CONFIG_WB_READS 1000
+
+  const volatile uint32_t* const wb = (const volatile uint32_t*)io->wb->vaddr;
+  unsigned int i;
+  unsigned int j;
+
+  for (j = 0; j != CONFIG_WB_READS; ++j)
+  {
+    for (i = 0; i != CONFIG_WB_SPINS; ++i)
+    {
+      if (wb[0] & (1 << 31))
+      {
+	io->sta = wb[0];
+	return 0;
+      }
+
+      cpu_relax();
+    }
+
+    if (pci_dev_read_word32(h->fd, DMA_REG_BAR, DMA_REG_STA, &io->sta))
+      return -1;
+
+    /* transfer error */
+    if (io->sta & (1 << 30)) return -1;
+
+    /* done, the writeback may still be in flight */
+    if (io->sta & (1 << 31)) return 0;
+  }
+
+  return -1;
+}
+
 static int dma_wait_io(dma_handle_t* h, dma_io_t* io)
 {
   /* wait for a previously initiated dma transfer */
 
+  if (io->wb != NULL)
+  {
+    if (poll_wb(h, io))
+    {
+      printf("poll_wb TIMEOUT or ERROR (0x%08x)\n", io->sta);
+      return -1;
+    }
+    goto on_done;
+  }
+
   /* poll registers for completion (dx_stat.running == 0) */
   while (1)
   {
@@ -279,6 +360,7 @@ static int dma_wait_io(dma_handle_t* h, dma_io_t* io)
     if (io->sta & (1 << 31)) break ;
   }
 
+ on_done:
   /* synchronize physical memory with cache hierarchy */
   dma_sync_pmem(h, io->buf);
 
@@ -478,9 +560,15 @@ int main(int ac, char** av)
   int err = -1;
   dma_handle_t h[CONFIG_MAX_DEV];
   dma_buf_t buf[CONFIG_MAX_DEV];
+  dma_buf_t wb[CONFIG_MAX_DEV];
   dma_io_t io[CONFIG_MAX_DEV];
   unsigned int i;
   unsigned int j;
+  /* devices with their buffers allocated */
+  unsigned int nbuf = 0;
+
+  /* poll the status writeback instead of waiting for interrupts */
+  const unsigned int is_poll = (ac > 1) && (strcmp(av[1], "poll") == 0);
 
   uint64_t start_ticks;
   uint64_t stop_ticks;
@@ -495,11 +583,27 @@ int main(int ac, char** av)
   {
     if (dma_open(&h[j])) goto on_error_0;
 
+    io[j].buf = NULL;
+    io[j].wb = NULL;
+
 #define CONFIG_MEM_SIZE (32 * 1024) /* in bytes */
     if (dma_alloc_buf(&h[j], &buf[j], CONFIG_MEM_SIZE))
-      goto on_error_2;
+      goto on_error_1;
 
     reset_buffer(&buf[j]);
+
+    if (is_poll)
+    {
+      if (dma_alloc_buf(&h[j], &wb[j], 2 * sizeof(uint32_t)))
+      {
+	dma_free_buf(&h[j], &buf[j]);
+	goto on_error_1;
+      }
+
+      io[j].wb = &wb[j];
+    }
+
+    nbuf = j + 1;
   }
 
   total_usecs = 0;
@@ -564,8 +668,11 @@ int main(int ac, char** av)
   err = 0;
 
  on_error_1:
-  for (j = 0; j < ndev; ++j) dma_free_buf(&h[j], &buf[j]);
- on_error_2:
+  for (j = 0; j < nbuf; ++j)
+  {
+    dma_free_buf(&h[j], &buf[j]);
+    if (io[j].wb != NULL) dma_free_buf(&h[j], io[j].wb);
+  }
   for (j = 0; j < ndev; ++j) dma_close(&h[j]);
  on_error_0:
   return err;
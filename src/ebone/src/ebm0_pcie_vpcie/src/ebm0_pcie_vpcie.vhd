@@ -281,6 +281,7 @@ entity ebm0_pcie_vpcie_master is
   pcie_req_bar: in std_ulogic_vector(work.pcie.BAR_WIDTH - 1 downto 0);
   pcie_req_addr: in std_ulogic_vector(work.pcie.ADDR_WIDTH - 1 downto 0);
   pcie_req_data: in std_ulogic_vector(work.pcie.DATA_WIDTH - 1 downto 0);
+  pcie_req_size: in std_ulogic_vector(work.pcie.SIZE_WIDTH - 1 downto 0);
   pcie_rep_en: out std_ulogic;
   pcie_rep_data: out std_ulogic_vector(work.pcie.DATA_WIDTH - 1 downto 0)
  );
@@ -332,6 +333,9 @@ architecture ebm0_pcie_vpcie_master_arch of ebm0_pcie_vpcie_master is
  signal req_bar: std_ulogic_vector(work.pcie.BAR_WIDTH - 1 downto 0);
  signal req_addr: std_ulogic_vector(work.pcie.ADDR_WIDTH - 1 downto 0);
 
+ -- byte offset of a narrow access in the word, in bits
+ signal req_shift: natural range 0 to 24;
+
  -- latch pcie reply data
  signal rep_data_en: std_ulogic;
 
@@ -565,6 +569,7 @@ begin
    req_is_read <= '0';
    req_bar <= (others => '0');
    req_addr <= (others => '0');
+   req_shift <= 0;
    req_w32_count <= x"0000";
    req_w32_count_minus_one <= x"0000";
    req_w32_count_minus_two <= x"0000";
@@ -573,28 +578,47 @@ begin
     req_is_read <= not pcie_req_wr;
     req_bar <= pcie_req_bar;
     req_addr <= pcie_req_addr;
-    req_w32_count <= x"0001";
-    req_w32_count_minus_one <= x"0000";
-    req_w32_count_minus_two <= x"ffff";
+    req_shift <= to_integer(unsigned(pcie_req_addr(1 downto 0))) * 8;
+    if work.pcie.DATA_WIDTH = 64 and unsigned(pcie_req_size) = 8 then
+     -- 64 bits access, low word first
+     req_w32_count <= x"0002";
+     req_w32_count_minus_one <= x"0001";
+     req_w32_count_minus_two <= x"0000";
+    else
+     req_w32_count <= x"0001";
+     req_w32_count_minus_one <= x"0000";
+     req_w32_count_minus_two <= x"ffff";
+    end if;
    end if;
   end if;
  end process;
 
- -- generate input word according to data_width
+ -- generate input word according to data_width. pcie data are in the
+ -- low order bytes, moved to the byte lanes of narrow accesses. ebone
+ -- has no byte enables: a narrow write writes the whole word.
 
  w32_generate: if work.pcie.DATA_WIDTH = 32 generate
-  process(pcie_req_data, eb_dat_i)
+  process(pcie_req_data, eb_dat_i, req_shift)
   begin
-   req_word(31 downto 0) <= std_logic_vector(pcie_req_data(31 downto 0));
-   rep_word(31 downto 0) <= std_ulogic_vector(eb_dat_i);
+   req_word(31 downto 0) <= std_logic_vector
+    (shift_left(unsigned(pcie_req_data(31 downto 0)), req_shift));
+   rep_word(31 downto 0) <= std_ulogic_vector
+    (shift_right(unsigned(eb_dat_i), req_shift));
   end process;
  end generate w32_generate;
 
  w64_generate: if work.pcie.DATA_WIDTH = 64 generate
-  process(pcie_req_data, eb_dat_i)
+  process(pcie_req_data, eb_dat_i, req_shift, burst_w32_reg)
   begin
-   req_word(31 downto 0) <= std_logic_vector(pcie_req_data(31 downto 0));
-   rep_word(63 downto 0) <= x"00000000" & std_ulogic_vector(eb_dat_i);
+   if burst_w32_reg(0) = '1' then
+    -- high word of a 64 bits access
+    req_word(31 downto 0) <= std_logic_vector(pcie_req_data(63 downto 32));
+   else
+    req_word(31 downto 0) <= std_logic_vector
+     (shift_left(unsigned(pcie_req_data(31 downto 0)), req_shift));
+   end if;
+   rep_word(63 downto 0) <= x"00000000" & std_ulogic_vector
+    (shift_right(unsigned(eb_dat_i), req_shift));
   end process;
  end generate w64_generate;
 
@@ -605,7 +629,13 @@ begin
    pcie_rep_data <= (others => '0');
   elsif rising_edge(clk) then
    if rep_data_en = '1' then
-    pcie_rep_data <= rep_word;
+    if burst_w32_reg(0) = '1' then
+     -- high word of a 64 bits access
+     pcie_rep_data(pcie_rep_data'left downto pcie_rep_data'left - 31) <=
+      std_ulogic_vector(eb_dat_i);
+    else
+     pcie_rep_data <= rep_word;
+    end if;
    end if;
   end if;
  end process;
@@ -668,6 +698,7 @@ architecture ebm0_pcie_vpcie_arch of ebm0_pcie_vpcie is
  signal pcie_req_bar: std_ulogic_vector(work.pcie.BAR_WIDTH - 1 downto 0);
  signal pcie_req_addr: std_ulogic_vector(work.pcie.ADDR_WIDTH - 1 downto 0);
  signal pcie_req_data: std_ulogic_vector(work.pcie.DATA_WIDTH - 1 downto 0);
+ signal pcie_req_size: std_ulogic_vector(work.pcie.SIZE_WIDTH - 1 downto 0);
  signal pcie_rep_en: std_ulogic;
  signal pcie_rep_data: std_ulogic_vector(work.pcie.DATA_WIDTH - 1 downto 0);
  signal pcie_mwr_en: std_ulogic;
@@ -692,6 +723,7 @@ begin
   req_bar => pcie_req_bar,
   req_addr => pcie_req_addr,
   req_data => pcie_req_data,
+  req_size => pcie_req_size,
   rep_en => pcie_rep_en,
   rep_data => pcie_rep_data,
   mwr_en => pcie_mwr_en,
@@ -733,6 +765,7 @@ begin
   pcie_req_bar => pcie_req_bar,
   pcie_req_addr => pcie_req_addr,
   pcie_req_data => pcie_req_data,
+  pcie_req_size => pcie_req_size,
   pcie_rep_en => pcie_rep_en,
   pcie_rep_data => pcie_rep_data
  );
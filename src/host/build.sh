@@ -0,0 +1,8 @@
+#!/usr/bin/env sh
+
+PCIE_DIR=../pcie
+
+gcc -Wall -Wstrict-aliasing=0 -O2 \
+-I. -I$PCIE_DIR \
+-o phost \
+main.c pcie_host.c
@@ -0,0 +1,242 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "pcie_host.h"
+
+
+/* host stand in command line. the commands are run in order on one
+   connection, for instance to start a main_dma transfer:
+
+   ./phost 127.0.0.1 42425 probe mw 1 0x8 0x1000 mw 1 0 0xc0008000 \
+     msi 1 1000000 stats
+
+   the device function is taken from PCIE_HOST_FUNC, 0 by default.
+ */
+
+static void usage(const char* s)
+{
+  printf("usage: %s addr port [command ...]\n", s);
+  printf(" addr: inet address, or unix:path (port is then unused)\n");
+  printf(" commands:\n");
+  printf("  probe                     probe and assign the bars\n");
+  printf("  cr addr [width]           config read\n");
+  printf("  cw addr value [width]     config write\n");
+  printf("  mr bar addr [width]       bar read\n");
+  printf("  mw bar addr value [width] bar write\n");
+  printf("  poll usecs                process device messages\n");
+  printf("  msi n usecs               wait for n msis in total\n");
+  printf("  dump addr size            print host memory\n");
+  printf("  stats                     print counters and rates\n");
+}
+
+static inline uint64_t arg(const char* s)
+{
+  return strtoull(s, NULL, 0);
+}
+
+static int get_width(char** av, int i, int ac, size_t* w)
+{
+  /* optional trailing width, commands never start with a digit */
+
+  *w = 4;
+
+  if (i >= ac) return 0;
+  if ((av[i][0] < '0') || (av[i][0] > '9')) return 0;
+
+  *w = (size_t)arg(av[i]);
+  return 1;
+}
+
+static void print_probe(const pcie_host_t* h)
+{
+  unsigned int i;
+
+  printf
+  (
+   "vendor 0x%04x device 0x%04x\n",
+   *(const uint16_t*)(h->config + 0x00),
+   *(const uint16_t*)(h->config + 0x02)
+  );
+
+  for (i = 0; i != PCIE_HOST_BAR_COUNT; ++i)
+  {
+    if (h->bar_size[i] == 0) continue ;
+    printf
+    (
+     "bar %u addr 0x%llx size 0x%llx\n", i,
+     (unsigned long long)h->bar_addr[i], (unsigned long long)h->bar_size[i]
+    );
+  }
+
+  for (i = 0; i != h->attr_count; ++i)
+  {
+    const pcie_net_attr_t* const a = &h->attrs[i];
+    printf
+    (
+     "attr 0x%02x bar %u addr 0x%llx size 0x%llx\n",
+     a->attr, a->bar,
+     (unsigned long long)a->addr, (unsigned long long)a->size
+    );
+  }
+}
+
+static void print_stats(const pcie_host_t* h)
+{
+  const pcie_host_stats_t* const s = &h->stats;
+  const uint64_t reads = s->config_reads + s->mem_reads;
+  const uint64_t ns = s->write_last_ns - s->write_first_ns;
+
+  printf
+  (
+   "config_reads %llu config_writes %llu mem_reads %llu mem_writes %llu\n",
+   (unsigned long long)s->config_reads, (unsigned long long)s->config_writes,
+   (unsigned long long)s->mem_reads, (unsigned long long)s->mem_writes
+  );
+
+  if (reads)
+  {
+    printf
+    (
+     "read_ns min %llu avg %llu max %llu\n",
+     (unsigned long long)s->read_ns_min,
+     (unsigned long long)(s->read_ns_sum / reads),
+     (unsigned long long)s->read_ns_max
+    );
+  }
+
+  printf
+  (
+   "device_writes %llu bytes %llu atomics %llu msis %llu\n",
+   (unsigned long long)s->write_msgs, (unsigned long long)s->write_bytes,
+   (unsigned long long)s->atomics, (unsigned long long)s->msis
+  );
+
+  /* from the first write to the last one */
+  if (ns)
+  {
+    printf
+    (
+     "write_throughput %.3f MB/s\n",
+     (double)s->write_bytes * 1000.0 / (double)ns
+    );
+  }
+}
+
+static void dump_mem(pcie_host_t* h, uint64_t addr, size_t size)
+{
+  uint8_t buf[16];
+  size_t i;
+
+  while (size)
+  {
+    const size_t n = (size < sizeof(buf)) ? size : sizeof(buf);
+
+    pcie_host_mem_read(h, addr, buf, n);
+
+    printf("%016llx:", (unsigned long long)addr);
+    for (i = 0; i != n; ++i) printf(" %02x", buf[i]);
+    printf("\n");
+
+    addr += n;
+    size -= n;
+  }
+}
+
+int main(int ac, char** av)
+{
+  pcie_host_t h;
+  unsigned int func = 0;
+  const char* s;
+  uint64_t x;
+  size_t width;
+  int err = -1;
+  int i;
+
+  if (ac < 3)
+  {
+    usage(av[0]);
+    return -1;
+  }
+
+  if ((s = getenv("PCIE_HOST_FUNC")) != NULL)
+    func = (unsigned int)strtoul(s, NULL, 0);
+
+  if (pcie_host_open(&h, av[1], av[2], func)) return -1;
+
+  for (i = 3; i != ac; ++i)
+  {
+    const char* const c = av[i];
+    const int n = ac - i - 1;
+
+    if (strcmp(c, "probe") == 0)
+    {
+      if (pcie_host_probe(&h, 0)) goto on_error;
+      print_probe(&h);
+    }
+    else if ((strcmp(c, "cr") == 0) && (n >= 1))
+    {
+      const uint64_t addr = arg(av[i + 1]);
+      i += 1 + get_width(av, i + 2, ac, &width);
+      if (pcie_host_read_config(&h, addr, width, &x)) goto on_error;
+      printf("0x%llx\n", (unsigned long long)x);
+    }
+    else if ((strcmp(c, "cw") == 0) && (n >= 2))
+    {
+      const uint64_t addr = arg(av[i + 1]);
+      x = arg(av[i + 2]);
+      i += 2 + get_width(av, i + 3, ac, &width);
+      if (pcie_host_write_config(&h, addr, width, x)) goto on_error;
+    }
+    else if ((strcmp(c, "mr") == 0) && (n >= 2))
+    {
+      const unsigned int bar = (unsigned int)arg(av[i + 1]);
+      const uint64_t addr = arg(av[i + 2]);
+      i += 2 + get_width(av, i + 3, ac, &width);
+      if (pcie_host_read_mem(&h, bar, addr, width, &x)) goto on_error;
+      printf("0x%llx\n", (unsigned long long)x);
+    }
+    else if ((strcmp(c, "mw") == 0) && (n >= 3))
+    {
+      const unsigned int bar = (unsigned int)arg(av[i + 1]);
+      const uint64_t addr = arg(av[i + 2]);
+      x = arg(av[i + 3]);
+      i += 3 + get_width(av, i + 4, ac, &width);
+      if (pcie_host_write_mem(&h, bar, addr, width, x)) goto on_error;
+    }
+    else if ((strcmp(c, "poll") == 0) && (n >= 1))
+    {
+      if (pcie_host_poll(&h, arg(av[i + 1]))) goto on_error;
+      i += 1;
+    }
+    else if ((strcmp(c, "msi") == 0) && (n >= 2))
+    {
+      const int res = pcie_host_wait_msi(&h, arg(av[i + 1]), arg(av[i + 2]));
+      if (res == -1) goto on_error;
+      printf("msi %llu%s\n",
+	     (unsigned long long)h.stats.msis, res ? " (timeout)" : "");
+      i += 2;
+    }
+    else if ((strcmp(c, "dump") == 0) && (n >= 2))
+    {
+      dump_mem(&h, arg(av[i + 1]), (size_t)arg(av[i + 2]));
+      i += 2;
+    }
+    else if (strcmp(c, "stats") == 0)
+    {
+      print_stats(&h);
+    }
+    else
+    {
+      printf("[!] invalid command: %s\n", c);
+      usage(av[0]);
+      goto on_error;
+    }
+  }
+
+  err = 0;
+
+ on_error:
+  pcie_host_close(&h);
+  return err;
+}
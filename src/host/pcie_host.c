@@ -0,0 +1,979 @@
+/* memfd_create */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "pcie_host.h"
+#include "pcie_net.h"
+
+
+#define CONFIG_DEBUG 1
+#if CONFIG_DEBUG
+#include <stdio.h>
+#define PRINTF(__s, ...)  \
+do { printf(__s, ## __VA_ARGS__); } while (0)
+#define PERROR() printf("[!] %s %d\n", __FUNCTION__, __LINE__)
+#else
+#define PRINTF(__s, ...)
+#define PERROR()
+#endif
+
+
+/* pci config registers used by the probe */
+#define CONFIG_COMMAND 0x04
+#define CONFIG_COMMAND_MEMORY (1 << 1)
+#define CONFIG_COMMAND_MASTER (1 << 2)
+#define CONFIG_BAR0 0x10
+#define CONFIG_BAR_FLAG_MASK 0xf
+#define CONFIG_BAR_MEM_64 (1 << 2)
+
+/* default bar bases, below 4GB unless 64 bits */
+#define BAR32_BASE 0xe0000000ULL
+#define BAR64_BASE 0x4000000000ULL
+
+#define RX_BUF_SIZE (64 * PCIE_NET_MSG_MAX_SIZE)
+
+
+uint64_t pcie_host_get_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+/* sparse memory */
+
+static inline size_t hash_page(uint64_t addr, size_t max)
+{
+  return (size_t)(((addr / PCIE_HOST_PAGE_SIZE) * 0x9e3779b97f4a7c15ULL) >> 32)
+    & (max - 1);
+}
+
+static pcie_host_page_t* probe_page(pcie_host_t* h, uint64_t addr)
+{
+  /* the slot holding addr, or the free slot to insert it */
+
+  size_t i = hash_page(addr, h->page_max);
+
+  while ((h->pages[i].addr != addr) && (h->pages[i].addr != PCIE_HOST_NO_PAGE))
+    i = (i + 1) & (h->page_max - 1);
+
+  return &h->pages[i];
+}
+
+static int grow_pages(pcie_host_t* h)
+{
+  pcie_host_page_t* const old = h->pages;
+  const size_t old_max = h->page_max;
+  size_t i;
+
+  h->page_max = old_max ? old_max * 2 : 1024;
+  h->pages = malloc(h->page_max * sizeof(pcie_host_page_t));
+  if (h->pages == NULL)
+  {
+    h->pages = old;
+    h->page_max = old_max;
+    return -1;
+  }
+
+  for (i = 0; i != h->page_max; ++i) h->pages[i].addr = PCIE_HOST_NO_PAGE;
+
+  for (i = 0; i != old_max; ++i)
+  {
+    if (old[i].addr == PCIE_HOST_NO_PAGE) continue ;
+    *probe_page(h, old[i].addr) = old[i];
+  }
+
+  free(old);
+
+  return 0;
+}
+
+static uint8_t* find_page(pcie_host_t* h, uint64_t addr, unsigned int do_alloc)
+{
+  pcie_host_page_t* p;
+
+  addr &= ~(uint64_t)(PCIE_HOST_PAGE_SIZE - 1);
+
+  if (h->page_max)
+  {
+    p = probe_page(h, addr);
+    if (p->addr == addr) return p->data;
+  }
+
+  if (do_alloc == 0) return NULL;
+
+  /* keep the table half empty */
+  if (((h->page_count + 1) * 2) > h->page_max)
+  {
+    if (grow_pages(h)) return NULL;
+  }
+
+  p = probe_page(h, addr);
+  p->data = calloc(1, PCIE_HOST_PAGE_SIZE);
+  if (p->data == NULL) return NULL;
+  p->addr = addr;
+  ++h->page_count;
+
+  return p->data;
+}
+
+static uint8_t* find_map(pcie_host_t* h, uint64_t addr, size_t size)
+{
+  size_t i;
+
+  for (i = 0; i != h->map_count; ++i)
+  {
+    const pcie_host_map_t* const m = &h->maps[i];
+    if ((addr >= m->addr) && ((addr + size) <= (m->addr + m->size)))
+      return m->base + (addr - m->addr);
+  }
+
+  return NULL;
+}
+
+void pcie_host_mem_read(pcie_host_t* h, uint64_t addr, void* buf, size_t size)
+{
+  uint8_t* p = buf;
+  const uint8_t* q;
+
+  if ((q = find_map(h, addr, size)) != NULL)
+  {
+    memcpy(buf, q, size);
+    return ;
+  }
+
+  while (size)
+  {
+    const size_t off = (size_t)(addr % PCIE_HOST_PAGE_SIZE);
+    const uint8_t* const page = find_page(h, addr, 0);
+    size_t n = PCIE_HOST_PAGE_SIZE - off;
+
+    if (n > size) n = size;
+    if (page == NULL) memset(p, 0, n);
+    else memcpy(p, page + off, n);
+
+    p += n;
+    addr += n;
+    size -= n;
+  }
+}
+
+int pcie_host_mem_write
+(pcie_host_t* h, uint64_t addr, const void* buf, size_t size)
+{
+  const uint8_t* p = buf;
+  uint8_t* q;
+
+  if ((q = find_map(h, addr, size)) != NULL)
+  {
+    memcpy(q, buf, size);
+    return 0;
+  }
+
+  while (size)
+  {
+    const size_t off = (size_t)(addr % PCIE_HOST_PAGE_SIZE);
+    uint8_t* const page = find_page(h, addr, 1);
+    size_t n = PCIE_HOST_PAGE_SIZE - off;
+
+    if (page == NULL) { PERROR(); return -1; }
+
+    if (n > size) n = size;
+    memcpy(page + off, p, n);
+
+    p += n;
+    addr += n;
+    size -= n;
+  }
+
+  return 0;
+}
+
+void pcie_host_mem_clear(pcie_host_t* h)
+{
+  size_t i;
+
+  for (i = 0; i != h->page_max; ++i)
+  {
+    if (h->pages[i].addr == PCIE_HOST_NO_PAGE) continue ;
+    free(h->pages[i].data);
+    h->pages[i].addr = PCIE_HOST_NO_PAGE;
+  }
+
+  h->page_count = 0;
+}
+
+
+/* transport */
+
+static int connect_unix(const char* path)
+{
+  struct sockaddr_un sun;
+  int fd;
+
+  if (strlen(path) >= sizeof(sun.sun_path)) { PERROR(); return -1; }
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) { PERROR(); return -1; }
+
+  if (connect(fd, (const struct sockaddr*)&sun, sizeof(sun)))
+  {
+    PERROR();
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int connect_inet(const char* addr, const char* port)
+{
+  static const int on = 1;
+
+  struct addrinfo hints;
+  struct addrinfo* ai;
+  int fd;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(addr, port, &hints, &ai)) { PERROR(); return -1; }
+
+  fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (fd == -1) { PERROR(); goto on_error; }
+
+  if (connect(fd, ai->ai_addr, ai->ai_addrlen))
+  {
+    PERROR();
+    close(fd);
+    fd = -1;
+    goto on_error;
+  }
+
+  /* reads and posted writes must not wait for acks */
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&on, sizeof(on));
+
+ on_error:
+  freeaddrinfo(ai);
+  return fd;
+}
+
+static int connect_any(const char* addr, const char* port)
+{
+  const size_t len = strlen(PCIE_NET_UNIX_PREFIX);
+
+  if (strncmp(addr, PCIE_NET_UNIX_PREFIX, len) == 0)
+    return connect_unix(addr + len);
+
+  return connect_inet(addr, port);
+}
+
+static int send_fd_msg(int fd, pcie_net_msg_t* m)
+{
+  const size_t size = offsetof(pcie_net_msg_t, data) + m->size;
+  const uint8_t* p = (const uint8_t*)m;
+  size_t off = 0;
+
+  m->header.size = (uint16_t)size;
+
+  while (off != size)
+  {
+    const ssize_t n = send(fd, p + off, size - off, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue ;
+      PERROR();
+      return -1;
+    }
+    off += (size_t)n;
+  }
+
+  return 0;
+}
+
+static inline int send_msg(pcie_host_t* h, pcie_net_msg_t* m)
+{
+  return send_fd_msg(h->fd, m);
+}
+
+static int next_msg(pcie_host_t* h, int64_t usecs, const pcie_net_msg_t** m)
+{
+  /* the next received message, in rx_buf until the next call. usecs
+     is the time to wait for it, -1 to block. return 0 if a message is
+     given, 1 on timeout, -1 on error.
+   */
+
+  /* the previous message is processed by now. rx_seq is read by the
+     lane threads, both are only accessed atomically.
+   */
+  __sync_fetch_and_add(&h->rx_seq, __sync_fetch_and_and(&h->rx_last, 0));
+
+  while (1)
+  {
+    const size_t avail = h->rx_size - h->rx_off;
+    const pcie_net_header_t* const hdr =
+      (const pcie_net_header_t*)(h->rx_buf + h->rx_off);
+    ssize_t n;
+
+    if (avail >= sizeof(pcie_net_header_t))
+    {
+      if (hdr->size < sizeof(pcie_net_header_t)) { PERROR(); return -1; }
+      if (hdr->size > PCIE_NET_MSG_MAX_SIZE) { PERROR(); return -1; }
+
+      if (avail >= hdr->size)
+      {
+	*m = (const pcie_net_msg_t*)hdr;
+	h->rx_off += hdr->size;
+	/* rx_last was cleared on entry */
+	__sync_fetch_and_add(&h->rx_last, hdr->size);
+	return 0;
+      }
+    }
+
+    /* partial message, moved to the start to receive the rest */
+    if (h->rx_off)
+    {
+      memmove(h->rx_buf, h->rx_buf + h->rx_off, avail);
+      h->rx_off = 0;
+      h->rx_size = avail;
+    }
+
+    if (usecs >= 0)
+    {
+      struct timeval tv;
+      fd_set rfds;
+      int err;
+
+      FD_ZERO(&rfds);
+      FD_SET(h->fd, &rfds);
+      tv.tv_sec = usecs / 1000000;
+      tv.tv_usec = usecs % 1000000;
+
+      err = select(h->fd + 1, &rfds, NULL, NULL, &tv);
+      if (err < 0)
+      {
+	if (errno == EINTR) continue ;
+	PERROR();
+	return -1;
+      }
+      if (err == 0) return 1;
+    }
+
+    n = recv(h->fd, h->rx_buf + h->rx_size, RX_BUF_SIZE - h->rx_size, 0);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue ;
+      PERROR();
+      return -1;
+    }
+    if (n == 0)
+    {
+      PRINTF("device closed\n");
+      return -1;
+    }
+
+    h->rx_size += (size_t)n;
+  }
+
+  /* not reached */
+  return -1;
+}
+
+static inline unsigned int is_reply(const pcie_net_msg_t* m)
+{
+  /* replies are shorter than any message */
+  return m->header.size <= sizeof(pcie_net_reply_t);
+}
+
+
+/* device requests */
+
+static int process_atomic(pcie_host_t* h, const pcie_net_msg_t* m)
+{
+  uint8_t buf[offsetof(pcie_net_msg_t, data) + sizeof(uint64_t)];
+  pcie_net_msg_t* const cpl = (pcie_net_msg_t*)buf;
+  const size_t w = m->width;
+  uint64_t mask;
+  uint64_t old = 0;
+  uint64_t x = 0;
+  uint64_t y = 0;
+
+  cpl->op = PCIE_NET_OP_ATOMIC_CPL;
+  cpl->bar = 1;
+  cpl->width = m->width;
+  cpl->addr = m->addr;
+  cpl->size = m->width;
+  memset(cpl->data, 0, sizeof(uint64_t));
+
+  if (((w != 4) && (w != 8)) || (m->size < w)) goto on_reply;
+
+  mask = (w == 8) ? (uint64_t)-1 : 0xffffffff;
+  pcie_host_mem_read(h, m->addr, &old, w);
+  memcpy(&x, m->data, w);
+
+  switch (m->op)
+  {
+  case PCIE_NET_OP_ATOMIC_FETCHADD: y = (old + x) & mask; break ;
+  case PCIE_NET_OP_ATOMIC_SWAP: y = x; break ;
+  default:
+    if (m->size < (2 * w)) goto on_reply;
+    y = old;
+    if (old == x) memcpy(&y, m->data + w, w);
+    break ;
+  }
+
+  if (pcie_host_mem_write(h, m->addr, &y, w)) goto on_reply;
+
+  memcpy(cpl->data, &old, w);
+  cpl->bar = 0;
+  ++h->stats.atomics;
+
+ on_reply:
+  return send_msg(h, cpl);
+}
+
+static int process_msg(pcie_host_t* h, const pcie_net_msg_t* m)
+{
+  switch (m->op)
+  {
+  case PCIE_NET_OP_WRITE_MEM:
+    {
+      const uint64_t now = pcie_host_get_ns();
+      if (h->stats.write_msgs == 0) h->stats.write_first_ns = now;
+      h->stats.write_last_ns = now;
+      ++h->stats.write_msgs;
+      h->stats.write_bytes += m->size;
+      return pcie_host_mem_write(h, m->addr, m->data, m->size);
+    }
+
+  case PCIE_NET_OP_INT:
+  case PCIE_NET_OP_MSI:
+  case PCIE_NET_OP_MSIX:
+    ++h->stats.msis;
+    if (h->msi_fn != NULL) h->msi_fn(h->msi_data);
+    break ;
+
+  case PCIE_NET_OP_ATOMIC_FETCHADD:
+  case PCIE_NET_OP_ATOMIC_SWAP:
+  case PCIE_NET_OP_ATOMIC_CAS:
+    return process_atomic(h, m);
+
+  /* the device wrote shared memory directly */
+  case PCIE_NET_OP_MEM_SYNC:
+    {
+      const uint64_t now = pcie_host_get_ns();
+      uint64_t size = 0;
+      if (m->size >= sizeof(size)) memcpy(&size, m->data, sizeof(size));
+      if (h->stats.write_msgs == 0) h->stats.write_first_ns = now;
+      h->stats.write_last_ns = now;
+      ++h->stats.write_msgs;
+      h->stats.write_bytes += size;
+      break ;
+    }
+
+  default:
+    PRINTF("[!] unexpected op %u\n", m->op);
+    break ;
+  }
+
+  return 0;
+}
+
+static int init_access
+(
+ pcie_host_t* h, pcie_net_msg_t* msg,
+ uint8_t op, unsigned int bar, uint64_t addr, size_t width
+)
+{
+  if ((width == 0) || (width > sizeof(uint64_t))) { PERROR(); return -1; }
+
+  msg->op = op;
+  msg->bar = (uint8_t)(bar | (h->func << PCIE_NET_FUNC_SHIFT));
+  msg->width = (uint8_t)width;
+  msg->addr = addr;
+  msg->size = 0;
+
+  return 0;
+}
+
+static int read_common
+(
+ pcie_host_t* h,
+ uint8_t op, unsigned int bar, uint64_t addr, size_t width,
+ uint64_t* x
+)
+{
+  uint8_t buf[offsetof(pcie_net_msg_t, data) + sizeof(uint64_t)];
+  pcie_net_msg_t* const msg = (pcie_net_msg_t*)buf;
+  const pcie_net_msg_t* m;
+  uint64_t t;
+
+  if (init_access(h, msg, op, bar, addr, width)) return -1;
+
+  t = pcie_host_get_ns();
+
+  if (send_msg(h, msg)) return -1;
+
+  /* the device writes sent before the reply are processed first */
+  while (1)
+  {
+    if (next_msg(h, -1, &m)) return -1;
+    if (is_reply(m)) break ;
+    if (process_msg(h, m)) return -1;
+  }
+
+  t = pcie_host_get_ns() - t;
+  if (t < h->stats.read_ns_min) h->stats.read_ns_min = t;
+  if (t > h->stats.read_ns_max) h->stats.read_ns_max = t;
+  h->stats.read_ns_sum += t;
+
+  *x = 0;
+  memcpy(x, ((const pcie_net_reply_t*)m)->data, width);
+
+  return 0;
+}
+
+static int write_common
+(
+ pcie_host_t* h,
+ uint8_t op, unsigned int bar, uint64_t addr, size_t width,
+ uint64_t x
+)
+{
+  uint8_t buf[offsetof(pcie_net_msg_t, data) + sizeof(uint64_t)];
+  pcie_net_msg_t* const msg = (pcie_net_msg_t*)buf;
+
+  if (init_access(h, msg, op, bar, addr, width)) return -1;
+  msg->size = (uint16_t)width;
+  memcpy(msg->data, &x, width);
+
+  return send_msg(h, msg);
+}
+
+
+/* exported api */
+
+void pcie_host_clear_stats(pcie_host_t* h)
+{
+  memset(&h->stats, 0, sizeof(h->stats));
+  h->stats.read_ns_min = (uint64_t)-1;
+}
+
+int pcie_host_open
+(pcie_host_t* h, const char* addr, const char* port, unsigned int func)
+{
+  h->func = func;
+  h->rx_off = 0;
+  h->rx_size = 0;
+  h->rx_seq = 0;
+  h->rx_last = 0;
+  h->map_count = 0;
+  h->attr_count = 0;
+  h->pages = NULL;
+  h->page_count = 0;
+  h->page_max = 0;
+  h->msi_fn = NULL;
+  h->msi_data = NULL;
+  memset(h->config, 0xff, sizeof(h->config));
+  memset(&h->probe, 0, sizeof(h->probe));
+  memset(h->bar_addr, 0, sizeof(h->bar_addr));
+  memset(h->bar_size, 0, sizeof(h->bar_size));
+  pcie_host_clear_stats(h);
+
+  h->rx_buf = malloc(RX_BUF_SIZE);
+  if (h->rx_buf == NULL) { PERROR(); return -1; }
+
+  h->fd = connect_any(addr, port);
+  if (h->fd == -1)
+  {
+    free(h->rx_buf);
+    return -1;
+  }
+
+  return 0;
+}
+
+int pcie_host_close(pcie_host_t* h)
+{
+  size_t i;
+
+  for (i = 0; i != h->map_count; ++i)
+  {
+    munmap(h->maps[i].base, h->maps[i].size);
+    close(h->maps[i].fd);
+  }
+
+  pcie_host_mem_clear(h);
+  free(h->pages);
+  free(h->rx_buf);
+  shutdown(h->fd, SHUT_RDWR);
+  close(h->fd);
+  return 0;
+}
+
+int pcie_host_probe(pcie_host_t* h, uint64_t base)
+{
+  /* same round trip as pciefw_probe_device, then the bars are placed
+     one after the other, each one aligned to its size.
+   */
+
+  uint8_t buf[offsetof(pcie_net_msg_t, data) + sizeof(uint64_t)];
+  pcie_net_msg_t* const msg = (pcie_net_msg_t*)buf;
+  const pcie_net_msg_t* m;
+  uint64_t base32 = base ? base : BAR32_BASE;
+  uint64_t base64 = base ? base : BAR64_BASE;
+  uint64_t cmd;
+  unsigned int i;
+
+  msg->op = PCIE_NET_OP_PROBE;
+  msg->bar = (uint8_t)(h->func << PCIE_NET_FUNC_SHIFT);
+  msg->width = 0;
+  msg->addr = 0;
+  msg->size = 0;
+  if (send_msg(h, msg)) return -1;
+
+  while (1)
+  {
+    if (next_msg(h, -1, &m)) return -1;
+
+    if (is_reply(m) || ((m->bar >> PCIE_NET_FUNC_SHIFT) != h->func))
+    {
+      /* not for the probe */
+      if (!is_reply(m) && process_msg(h, m)) return -1;
+    }
+    else if (m->op == PCIE_NET_OP_PROBE_CONFIG)
+    {
+      if ((m->addr + m->size) > sizeof(h->config)) { PERROR(); return -1; }
+      memcpy(h->config + m->addr, m->data, m->size);
+    }
+    else if (m->op == PCIE_NET_OP_PROBE_ATTR)
+    {
+      h->attr_count = m->size / sizeof(pcie_net_attr_t);
+      if (h->attr_count > PCIE_HOST_ATTR_COUNT)
+	h->attr_count = PCIE_HOST_ATTR_COUNT;
+      memcpy(h->attrs, m->data, h->attr_count * sizeof(pcie_net_attr_t));
+    }
+    else if (m->op == PCIE_NET_OP_PROBE_DONE)
+    {
+      if (m->size < sizeof(h->probe)) { PERROR(); return -1; }
+      memcpy(&h->probe, m->data, sizeof(h->probe));
+      break ;
+    }
+    else if (process_msg(h, m))
+    {
+      return -1;
+    }
+  }
+
+  for (i = 0; i != PCIE_HOST_BAR_COUNT; ++i)
+  {
+    const uint64_t config_addr = CONFIG_BAR0 + i * 4;
+    const uint32_t mask = h->probe.bar_mask[i];
+    uint32_t high = (uint32_t)-1;
+    uint64_t* pos;
+    uint64_t size;
+
+    h->bar_addr[i] = 0;
+    h->bar_size[i] = 0;
+
+    if (mask == 0) continue ;
+
+    if ((mask & CONFIG_BAR_MEM_64) && ((i + 1) != PCIE_HOST_BAR_COUNT))
+      high = h->probe.bar_mask[i + 1];
+
+    size = ~(((uint64_t)high << 32) | (mask & ~CONFIG_BAR_FLAG_MASK)) + 1;
+    if (size == 0) continue ;
+
+    pos = (mask & CONFIG_BAR_MEM_64) ? &base64 : &base32;
+    *pos = (*pos + size - 1) & ~(size - 1);
+
+    h->bar_addr[i] = *pos;
+    h->bar_size[i] = size;
+    *pos += size;
+
+    if (pcie_host_write_config(h, config_addr, 4, h->bar_addr[i] & 0xffffffff))
+      return -1;
+
+    /* skip the upper half */
+    if (mask & CONFIG_BAR_MEM_64)
+    {
+      if (pcie_host_write_config(h, config_addr + 4, 4, h->bar_addr[i] >> 32))
+	return -1;
+      ++i;
+    }
+  }
+
+  if (pcie_host_read_config(h, CONFIG_COMMAND, 2, &cmd)) return -1;
+  cmd |= CONFIG_COMMAND_MEMORY | CONFIG_COMMAND_MASTER;
+  return pcie_host_write_config(h, CONFIG_COMMAND, 2, cmd);
+}
+
+int pcie_host_read_config
+(pcie_host_t* h, uint64_t addr, size_t width, uint64_t* x)
+{
+  ++h->stats.config_reads;
+  return read_common(h, PCIE_NET_OP_READ_CONFIG, 0, addr, width, x);
+}
+
+int pcie_host_write_config
+(pcie_host_t* h, uint64_t addr, size_t width, uint64_t x)
+{
+  ++h->stats.config_writes;
+  return write_common(h, PCIE_NET_OP_WRITE_CONFIG, 0, addr, width, x);
+}
+
+int pcie_host_read_mem
+(pcie_host_t* h, unsigned int bar, uint64_t addr, size_t width, uint64_t* x)
+{
+  ++h->stats.mem_reads;
+  return read_common(h, PCIE_NET_OP_READ_MEM, bar, addr, width, x);
+}
+
+int pcie_host_write_mem
+(pcie_host_t* h, unsigned int bar, uint64_t addr, size_t width, uint64_t x)
+{
+  ++h->stats.mem_writes;
+  return write_common(h, PCIE_NET_OP_WRITE_MEM, bar, addr, width, x);
+}
+
+int pcie_host_poll(pcie_host_t* h, uint64_t usecs)
+{
+  const uint64_t deadline = pcie_host_get_ns() + usecs * 1000;
+  const pcie_net_msg_t* m;
+  int err;
+
+  while (1)
+  {
+    const uint64_t now = pcie_host_get_ns();
+    const int64_t rem = (now < deadline) ? (int64_t)(deadline - now) / 1000 : 0;
+
+    err = next_msg(h, rem, &m);
+    if (err == 1) return 0;
+    if (err == -1) return -1;
+
+    /* a reply without request, the device is confused */
+    if (is_reply(m)) { PERROR(); continue ; }
+
+    if (process_msg(h, m)) return -1;
+  }
+
+  /* not reached */
+  return 0;
+}
+
+int pcie_host_wait_msi(pcie_host_t* h, uint64_t n, uint64_t usecs)
+{
+  const uint64_t deadline = pcie_host_get_ns() + usecs * 1000;
+  const pcie_net_msg_t* m;
+  int err;
+
+  while (h->stats.msis < n)
+  {
+    const uint64_t now = pcie_host_get_ns();
+
+    if (now >= deadline) return 1;
+
+    err = next_msg(h, (int64_t)(deadline - now) / 1000, &m);
+    if (err == 1) return 1;
+    if (err == -1) return -1;
+
+    if (is_reply(m)) { PERROR(); continue ; }
+
+    if (process_msg(h, m)) return -1;
+  }
+
+  return 0;
+}
+
+int pcie_host_open_lane
+(
+ pcie_host_t* h, pcie_host_lane_t* l,
+ const char* addr, const char* port, unsigned int index
+)
+{
+  uint8_t buf[offsetof(pcie_net_msg_t, data) + sizeof(uint64_t)];
+  pcie_net_msg_t* const msg = (pcie_net_msg_t*)buf;
+  pcie_net_lane_reply_t reply;
+
+  l->host = h;
+  l->fd = connect_any(addr, port);
+  if (l->fd == -1) return -1;
+
+  msg->op = PCIE_NET_OP_LANE;
+  msg->bar = (uint8_t)(h->func << PCIE_NET_FUNC_SHIFT);
+  msg->width = 0;
+  msg->addr = index;
+  msg->size = 0;
+  if (send_fd_msg(l->fd, msg)) goto on_error;
+
+  /* the first reply accepts the lane, a refusing device closes it */
+  if (recv(l->fd, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply))
+  {
+    PRINTF("[!] lane %u refused\n", index);
+    goto on_error;
+  }
+
+  return 0;
+
+ on_error:
+  close(l->fd);
+  l->fd = -1;
+  return -1;
+}
+
+int pcie_host_close_lane(pcie_host_lane_t* l)
+{
+  shutdown(l->fd, SHUT_RDWR);
+  close(l->fd);
+  l->fd = -1;
+  return 0;
+}
+
+int pcie_host_lane_read_mem
+(
+ pcie_host_lane_t* l,
+ unsigned int bar, uint64_t addr, size_t width,
+ uint64_t* x
+)
+{
+  uint8_t buf[offsetof(pcie_net_msg_t, data) + sizeof(uint64_t)];
+  pcie_net_msg_t* const msg = (pcie_net_msg_t*)buf;
+  pcie_host_t* const h = l->host;
+  pcie_net_lane_reply_t reply;
+
+  if (init_access(h, msg, PCIE_NET_OP_READ_MEM, bar, addr, width)) return -1;
+  if (send_fd_msg(l->fd, msg)) return -1;
+
+  if (recv(l->fd, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply))
+  {
+    PERROR();
+    return -1;
+  }
+
+  /* the device writes sent before the reply are processed first */
+  while (__sync_fetch_and_add(&h->rx_seq, 0) < reply.seq) sched_yield();
+
+  *x = 0;
+  memcpy(x, reply.data, width);
+
+  return 0;
+}
+
+int pcie_host_lane_write_mem
+(
+ pcie_host_lane_t* l,
+ unsigned int bar, uint64_t addr, size_t width,
+ uint64_t x
+)
+{
+  uint8_t buf[offsetof(pcie_net_msg_t, data) + sizeof(uint64_t)];
+  pcie_net_msg_t* const msg = (pcie_net_msg_t*)buf;
+
+  if (init_access(l->host, msg, PCIE_NET_OP_WRITE_MEM, bar, addr, width))
+    return -1;
+  msg->size = (uint16_t)width;
+  memcpy(msg->data, &x, width);
+
+  return send_fd_msg(l->fd, msg);
+}
+
+static int send_mem_map(pcie_host_t* h)
+{
+  /* all the maps in one message, their fds passed along */
+
+  uint8_t buf[offsetof(pcie_net_msg_t, data) +
+	      PCIE_HOST_MAP_COUNT * sizeof(pcie_net_mem_map_t)];
+  uint8_t cbuf[CMSG_SPACE(PCIE_HOST_MAP_COUNT * sizeof(int))];
+  pcie_net_msg_t* const msg = (pcie_net_msg_t*)buf;
+  pcie_net_mem_map_t* const e = (pcie_net_mem_map_t*)msg->data;
+  struct cmsghdr* cm;
+  struct msghdr mh;
+  struct iovec iov;
+  int* fds;
+  size_t i;
+
+  msg->op = PCIE_NET_OP_MEM_MAP;
+  msg->bar = (uint8_t)(h->func << PCIE_NET_FUNC_SHIFT);
+  msg->width = 0;
+  msg->addr = 0;
+  msg->size = (uint16_t)(h->map_count * sizeof(pcie_net_mem_map_t));
+  msg->header.size = (uint16_t)(offsetof(pcie_net_msg_t, data) + msg->size);
+
+  iov.iov_base = buf;
+  iov.iov_len = msg->header.size;
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cbuf;
+  mh.msg_controllen = CMSG_SPACE(h->map_count * sizeof(int));
+
+  cm = CMSG_FIRSTHDR(&mh);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(h->map_count * sizeof(int));
+  fds = (int*)CMSG_DATA(cm);
+
+  for (i = 0; i != h->map_count; ++i)
+  {
+    e[i].addr = h->maps[i].addr;
+    e[i].size = h->maps[i].size;
+    e[i].off = 0;
+    fds[i] = h->maps[i].fd;
+  }
+
+  if (sendmsg(h->fd, &mh, MSG_NOSIGNAL) != (ssize_t)iov.iov_len)
+  {
+    PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+int pcie_host_map_mem(pcie_host_t* h, uint64_t addr, uint64_t size)
+{
+  pcie_host_map_t* const m = &h->maps[h->map_count];
+
+  if (h->map_count == PCIE_HOST_MAP_COUNT) { PERROR(); return -1; }
+
+  m->fd = memfd_create("pcie_host", 0);
+  if (m->fd == -1) { PERROR(); return -1; }
+
+  if (ftruncate(m->fd, (off_t)size)) { PERROR(); goto on_error; }
+
+  m->base = mmap
+    (NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+  if (m->base == MAP_FAILED) { PERROR(); goto on_error; }
+
+  m->addr = addr;
+  m->size = size;
+  ++h->map_count;
+
+  if (send_mem_map(h) == 0) return 0;
+
+  --h->map_count;
+  munmap(m->base, (size_t)size);
+
+ on_error:
+  close(m->fd);
+  return -1;
+}
@@ -0,0 +1,187 @@
+#ifndef PCIE_HOST_H_INCLUDED
+# define PCIE_HOST_H_INCLUDED
+
+
+/* host side of pcie_net, standing in for qemu and pciefw. it probes
+   the device as pciefw_probe_device does, issues config and bar
+   accesses, and sinks the device writes in a sparse memory. no guest
+   nor driver is involved, so that a device model can be exercised and
+   measured from a plain process.
+
+   the device messages (writes, atomics, msi) are processed while
+   waiting for a read reply, or by pcie_host_poll.
+ */
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include "pcie_net.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+typedef struct pcie_host_page
+{
+  /* page address, PCIE_HOST_NO_PAGE if the slot is free */
+#define PCIE_HOST_NO_PAGE ((uint64_t)-1)
+  uint64_t addr;
+  uint8_t* data;
+} pcie_host_page_t;
+
+typedef struct pcie_host_map
+{
+  /* host memory at addr is shared with the device, refer to
+     pcie_host_map_mem
+   */
+  uint64_t addr;
+  uint64_t size;
+  uint8_t* base;
+  int fd;
+} pcie_host_map_t;
+
+typedef struct pcie_host_stats
+{
+  /* host requests */
+  uint64_t config_reads;
+  uint64_t config_writes;
+  uint64_t mem_reads;
+  uint64_t mem_writes;
+
+  /* read round trips, in nanoseconds */
+  uint64_t read_ns_min;
+  uint64_t read_ns_max;
+  uint64_t read_ns_sum;
+
+  /* device requests */
+  uint64_t write_msgs;
+  uint64_t write_bytes;
+  uint64_t atomics;
+  uint64_t msis;
+
+  /* first and last device write, for the throughput */
+  uint64_t write_first_ns;
+  uint64_t write_last_ns;
+} pcie_host_stats_t;
+
+typedef struct pcie_host
+{
+  /* device connection */
+  int fd;
+  unsigned int func;
+
+  /* received bytes not processed yet */
+  uint8_t* rx_buf;
+  size_t rx_off;
+  size_t rx_size;
+  /* bytes processed on fd, refer to pcie_net_lane_reply_t. the last
+     message counts from the next one on.
+   */
+  uint64_t rx_seq;
+  size_t rx_last;
+
+  /* probe results: config image, bar layout and range attributes */
+  uint8_t config[0x1000];
+  pcie_net_probe_t probe;
+#define PCIE_HOST_ATTR_COUNT 32
+  pcie_net_attr_t attrs[PCIE_HOST_ATTR_COUNT];
+  size_t attr_count;
+  /* addresses assigned by pcie_host_probe, 0 if unused */
+#define PCIE_HOST_BAR_COUNT 6
+  uint64_t bar_addr[PCIE_HOST_BAR_COUNT];
+  uint64_t bar_size[PCIE_HOST_BAR_COUNT];
+
+  /* sparse memory, pages allocated on first write, open addressing */
+#define PCIE_HOST_PAGE_SIZE 0x1000
+  pcie_host_page_t* pages;
+  size_t page_count;
+  size_t page_max;
+
+  /* shared memory, looked up before the sparse one */
+#define PCIE_HOST_MAP_COUNT PCIE_NET_FD_COUNT
+  pcie_host_map_t maps[PCIE_HOST_MAP_COUNT];
+  size_t map_count;
+
+  /* called after an msi is counted */
+  void (*msi_fn)(void*);
+  void* msi_data;
+
+  pcie_host_stats_t stats;
+} pcie_host_t;
+
+typedef struct pcie_host_lane
+{
+  pcie_host_t* host;
+  int fd;
+} pcie_host_lane_t;
+
+
+/* addr is an inet address with port, or PCIE_NET_UNIX_PREFIX followed
+   by the path of a unix socket, port being then unused. func is the
+   device function the accesses go to.
+ */
+int pcie_host_open(pcie_host_t*, const char*, const char*, unsigned int);
+int pcie_host_close(pcie_host_t*);
+
+/* fetch the config image, assign the bars from base and enable memory
+   decoding. a 0 base keeps the default, above 4GB for 64 bits bars.
+ */
+int pcie_host_probe(pcie_host_t*, uint64_t);
+
+/* reads wait for the reply, writes are posted */
+int pcie_host_read_config(pcie_host_t*, uint64_t, size_t, uint64_t*);
+int pcie_host_write_config(pcie_host_t*, uint64_t, size_t, uint64_t);
+int pcie_host_read_mem(pcie_host_t*, unsigned int, uint64_t, size_t, uint64_t*);
+int pcie_host_write_mem(pcie_host_t*, unsigned int, uint64_t, size_t, uint64_t);
+
+/* process device messages for usecs, only the pending ones if 0 */
+int pcie_host_poll(pcie_host_t*, uint64_t);
+
+/* process device messages until n msis are counted in total, or usecs
+   elapsed. return 0 if counted, 1 on timeout, -1 on error.
+ */
+int pcie_host_wait_msi(pcie_host_t*, uint64_t, uint64_t);
+
+/* extra connection for the memory accesses of one thread, index being
+   the lane number, refer to PCIE_NET_OP_LANE. lane accesses are not
+   counted in the host stats.
+   a lane read completes once the device writes sent before it are
+   processed, and it waits for them. it does not read the main
+   connection itself: a pump thread is required, serving the main
+   connection with pcie_host_poll (or wait_msi) meanwhile. otherwise
+   lane reads block as soon as the device writes to the host.
+ */
+int pcie_host_open_lane
+(pcie_host_t*, pcie_host_lane_t*, const char*, const char*, unsigned int);
+int pcie_host_close_lane(pcie_host_lane_t*);
+int pcie_host_lane_read_mem
+(pcie_host_lane_t*, unsigned int, uint64_t, size_t, uint64_t*);
+int pcie_host_lane_write_mem
+(pcie_host_lane_t*, unsigned int, uint64_t, size_t, uint64_t);
+
+/* share size bytes of host memory at addr with the device, over unix
+   sockets only. the device then writes them directly and sends
+   MEM_SYNC markers, refer to PCIE_NET_OP_MEM_MAP. the current sparse
+   contents of the range are not copied.
+ */
+int pcie_host_map_mem(pcie_host_t*, uint64_t, uint64_t);
+
+/* host memory, the bytes never written read as 0 */
+void pcie_host_mem_read(pcie_host_t*, uint64_t, void*, size_t);
+int pcie_host_mem_write(pcie_host_t*, uint64_t, const void*, size_t);
+void pcie_host_mem_clear(pcie_host_t*);
+
+/* monotonic clock, in nanoseconds */
+uint64_t pcie_host_get_ns(void);
+
+void pcie_host_clear_stats(pcie_host_t*);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* PCIE_HOST_H_INCLUDED */
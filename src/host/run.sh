@@ -0,0 +1,4 @@
+#!/usr/bin/env sh
+./phost 127.0.0.1 42425 probe \
+mw 1 0x8 0x1000 mw 1 0xc 0 mw 1 0 0xc0008000 \
+msi 1 1000000 mr 1 0x4 stats
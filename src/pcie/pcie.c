@@ -1,10 +1,17 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sched.h>
 #include "pcie.h"
 #include "pcie_net.h"
 
 
+#ifndef CONFIG_DEBUG
 #define CONFIG_DEBUG 1
+#endif
 #if CONFIG_DEBUG
 #include <stdio.h>
 #define PRINTF(__s, ...)  \
@@ -16,6 +23,65 @@ do { printf(__s, ## __VA_ARGS__); } while (0)
 #endif
 
 
+/* counters, updated by the loop and lane threads */
+
+#define STATS_ADD(__dev, __name, __n) \
+  __sync_fetch_and_add(&(__dev)->stats.__name, (uint64_t)(__n))
+
+
+/* pci express capability */
+
+#define EXP_CAP_OFF 0x50
+
+static unsigned int size_to_pcie_code(unsigned int size)
+{
+  /* 128 << code */
+  unsigned int code = 0;
+  while ((128U << code) < size) ++code;
+  return code;
+}
+
+static void update_exp_cap(pcie_dev_t* dev)
+{
+  /* write the link model state in the capability registers */
+
+  const unsigned int gen = dev->link.gen ? dev->link.gen : 1;
+  const unsigned int lnk = (dev->link.width << 4) | gen;
+  uint16_t devctl;
+
+  devctl = pcie_read_config_word(dev, EXP_CAP_OFF + PCI_EXP_DEVCTL);
+  devctl &= ~(PCI_EXP_DEVCTL_PAYLOAD | PCI_EXP_DEVCTL_READRQ);
+  devctl |= size_to_pcie_code(dev->link.mps) << 5;
+  devctl |= size_to_pcie_code(dev->link.mrrs) << 12;
+
+  pcie_write_config_word(dev, EXP_CAP_OFF + PCI_EXP_DEVCTL, devctl);
+  pcie_write_config_long(dev, EXP_CAP_OFF + PCI_EXP_LNKCAP, lnk);
+  pcie_write_config_word(dev, EXP_CAP_OFF + PCI_EXP_LNKSTA, lnk);
+}
+
+static void on_write_devctl(pcie_dev_t* dev)
+{
+  /* the host programmed mps and mrrs. mps is limited by devcap. */
+
+  const uint16_t devctl =
+    pcie_read_config_word(dev, EXP_CAP_OFF + PCI_EXP_DEVCTL);
+  const unsigned int max_code =
+    pcie_read_config_long(dev, EXP_CAP_OFF + PCI_EXP_DEVCAP) &
+    PCI_EXP_DEVCAP_PAYLOAD;
+  unsigned int code;
+
+  code = (devctl & PCI_EXP_DEVCTL_PAYLOAD) >> 5;
+  if (code > max_code) code = max_code;
+  dev->link.mps = 128 << code;
+
+  /* 4096 bytes max */
+  code = (devctl & PCI_EXP_DEVCTL_READRQ) >> 12;
+  if (code > 5) code = 5;
+  dev->link.mrrs = 128 << code;
+
+  PRINTF("%s: mps %u mrrs %u\n", __FUNCTION__, dev->link.mps, dev->link.mrrs);
+}
+
 static void init_common(pcie_dev_t* dev)
 {
   unsigned int i;
@@ -25,9 +91,36 @@ static void init_common(pcie_dev_t* dev)
     dev->bar_size[i] = 0;
     dev->bar_writefn[i] = NULL;
     dev->bar_readfn[i] = NULL;
+    dev->bar_regmap[i] = NULL;
+    dev->bar_mem[i] = NULL;
+    dev->bar_type[i] = 0;
   }
 
   memset(dev->config, 0, sizeof(dev->config));
+  memset(dev->config_volatile, 0, sizeof(dev->config_volatile));
+  dev->attr_count = 0;
+  dev->doorbell_count = 0;
+  dev->msi_fd = -1;
+  dev->has_posted = 0;
+  dev->host_map_count = 0;
+
+  dev->link.gen = 0;
+  dev->link.width = 1;
+  dev->link.mps = 128;
+  dev->link.mrrs = 512;
+
+  memset(&dev->stats, 0, sizeof(dev->stats));
+
+  dev->dma_head = NULL;
+  dev->dma_tail = NULL;
+  dev->dma_in_task = 0;
+
+  dev->atomic_head = NULL;
+  dev->atomic_tail = NULL;
+
+  dev->pf = NULL;
+  dev->fn = 0;
+  for (i = 0; i < PCIE_FUNC_COUNT; ++i) dev->vfs[i] = NULL;
 
   /* TODO: use pcie_write_config_xxx_safe versions */
   
@@ -47,8 +140,113 @@ static void init_common(pcie_dev_t* dev)
 #define MSI_CAP_OFF (16 * 4)
   pcie_write_config_byte(dev, PCI_CAPABILITY_LIST, MSI_CAP_OFF);
   pcie_write_config_byte(dev, MSI_CAP_OFF + 0x00, 0x05);
-  pcie_write_config_byte(dev, MSI_CAP_OFF + 0x01, 0x00);
+  pcie_write_config_byte(dev, MSI_CAP_OFF + PCI_CAP_LIST_NEXT, EXP_CAP_OFF);
   pcie_write_config_word(dev, MSI_CAP_OFF + 0x02, 0x01);
+
+  /* pci express capability structure, version 2 endpoint. it ends the
+     list. link fields reflect pcie_set_link parameters.
+   */
+  pcie_write_config_byte(dev, EXP_CAP_OFF + PCI_CAP_LIST_ID, PCI_CAP_ID_EXP);
+  pcie_write_config_byte(dev, EXP_CAP_OFF + PCI_CAP_LIST_NEXT, 0x00);
+  pcie_write_config_word
+    (dev, EXP_CAP_OFF + PCI_EXP_FLAGS, 0x02 | (PCI_EXP_TYPE_ENDPOINT << 4));
+  /* 4096 bytes max payload supported */
+  pcie_write_config_long(dev, EXP_CAP_OFF + PCI_EXP_DEVCAP, 0x05);
+  update_exp_cap(dev);
+
+  /* changed by pcie_set_link, or status bits */
+  pcie_set_config_volatile(dev, PCI_COMMAND, 4);
+  pcie_set_config_volatile(dev, EXP_CAP_OFF + PCI_EXP_LNKCTL, 4);
+}
+
+
+/* link model */
+
+static uint64_t link_wire_ns(const pcie_link_t* link, size_t size)
+{
+  /* time to transmit size payload bytes, split in mps sized TLPs */
+
+  size_t ntlps = (size + link->mps - 1) / link->mps;
+  if (ntlps == 0) ntlps = 1;
+  return (uint64_t)((double)(size + ntlps * link->tlp_overhead) / link->rate);
+}
+
+static uint64_t link_queue(pcie_dev_t* dev, uint64_t now, size_t size)
+{
+  /* the transmitter is busy until previous TLPs are sent. returns the
+     date this one is sent, to be waited for without the lock.
+   */
+
+  pcie_dev_t* const root = pcie_root(dev);
+  pcie_link_t* const link = &root->link;
+
+  pcie_net_lock(&root->net);
+  if (now < link->busy_ns) now = link->busy_ns;
+  link->busy_ns = now + link_wire_ns(link, size);
+  now = link->busy_ns;
+  pcie_net_unlock(&root->net);
+
+  return now;
+}
+
+static void link_send(pcie_dev_t* dev, size_t size)
+{
+  pcie_dev_t* const root = pcie_root(dev);
+  const uint64_t ns = link_queue(root, pcie_net_get_ns(&root->net), size);
+  pcie_net_wait_ns(&root->net, ns);
+}
+
+static void link_complete(pcie_dev_t* dev, uint64_t recv_ns, size_t size)
+{
+  /* read request header, round trip and completion with data */
+
+  pcie_dev_t* const root = pcie_root(dev);
+  pcie_link_t* const link = &root->link;
+  uint64_t ns;
+
+  ns = recv_ns + 2 * link->latency + link_wire_ns(link, 0);
+
+  pcie_net_lock(&root->net);
+  if (ns < link->busy_ns) ns = link->busy_ns;
+  link->busy_ns = ns + link_wire_ns(link, size);
+  ns = link->busy_ns;
+  pcie_net_unlock(&root->net);
+
+  pcie_net_wait_ns(&root->net, ns);
+}
+
+static unsigned int is_link_width(unsigned int width)
+{
+  /* negotiable widths, as in the link capabilities */
+  switch (width)
+  {
+  case 1: case 2: case 4: case 8: case 12: case 16: return 1;
+  default: break ;
+  }
+  return 0;
+}
+
+static void init_link_env(pcie_dev_t* dev)
+{
+  unsigned int gen = 0;
+  unsigned int width = 1;
+  unsigned int mps = 128;
+  unsigned int mrrs = 512;
+  const char* s;
+
+  if ((s = getenv("PCIE_LINK_GEN")) != NULL) gen = strtoul(s, NULL, 10);
+  if ((s = getenv("PCIE_LINK_WIDTH")) != NULL) width = strtoul(s, NULL, 10);
+  if ((s = getenv("PCIE_LINK_MPS")) != NULL) mps = strtoul(s, NULL, 10);
+  if ((s = getenv("PCIE_LINK_MRRS")) != NULL) mrrs = strtoul(s, NULL, 10);
+
+  if (gen == 0) return ;
+
+  if (is_link_width(width) == 0) { PERROR(); return ; }
+
+  if (pcie_set_link(dev, gen, width, mps, mrrs)) { PERROR(); return ; }
+
+  if ((s = getenv("PCIE_LINK_LATENCY")) != NULL)
+    dev->link.latency = strtoul(s, NULL, 10);
 }
 
 
@@ -68,15 +266,92 @@ int pcie_init_net
   if (pcie_net_init(&dev->net, laddr, lport, raddr, rport) == -1)
     return -1;
 
+  init_link_env(dev);
+
   return 0;
 }
 
+static void close_doorbells(pcie_dev_t* dev)
+{
+  pcie_dev_t* const root = pcie_root(dev);
+  size_t i;
+
+  for (i = 0; i != dev->doorbell_count; ++i)
+  {
+    pcie_doorbell_t* const db = &dev->doorbells[i];
+    if (db->fd == -1) continue ;
+    pcie_net_del_fd(&root->net, db->fd);
+    close(db->fd);
+    db->fd = -1;
+  }
+}
+
+static void dma_cancel_all(pcie_dev_t*);
+static void atomic_cancel_all(pcie_dev_t*);
+static void atomic_orphan_all(pcie_dev_t*);
+static void unmap_host_mem(pcie_dev_t*);
+
 int pcie_fini(pcie_dev_t* dev)
 {
+  dma_cancel_all(dev);
+  if (dev->pf == NULL) atomic_cancel_all(dev);
+  else atomic_orphan_all(dev);
+  close_doorbells(dev);
+  if (dev->msi_fd != -1) close(dev->msi_fd);
+  dev->msi_fd = -1;
+
+  PRINTF
+  (
+   "%s(%u): tx_tlps %lu tx_bytes %lu rx_tlps %lu rx_bytes %lu\n",
+   __FUNCTION__, dev->fn,
+   (unsigned long)dev->stats.tx_tlps, (unsigned long)dev->stats.tx_bytes,
+   (unsigned long)dev->stats.rx_tlps, (unsigned long)dev->stats.rx_bytes
+  );
+
+  if (dev->pf != NULL)
+  {
+    /* virtual function, the connection belongs to the pf */
+    dev->pf->vfs[dev->fn] = NULL;
+    dev->pf = NULL;
+    return 0;
+  }
+
+  unmap_host_mem(dev);
   pcie_net_fini(&dev->net);
   return 0;
 }
 
+int pcie_set_config_volatile(pcie_dev_t* dev, uint64_t addr, size_t size)
+{
+  uint64_t i;
+
+  if ((addr + size) > sizeof(dev->config)) return -1;
+
+  for (i = addr / 4; i < (addr + size + 3) / 4; ++i)
+    dev->config_volatile[i / 32] |= 1U << (i % 32);
+
+  return 0;
+}
+
+int pcie_init_vf(pcie_dev_t* vf, pcie_dev_t* pf, unsigned int fn)
+{
+  if ((fn == 0) || (fn >= PCIE_FUNC_COUNT)) return -1;
+  if (pf->pf != NULL) return -1;
+  if (pf->vfs[fn] != NULL) return -1;
+
+  init_common(vf);
+
+  vf->pf = pf;
+  vf->fn = fn;
+  vf->link.mps = pf->link.mps;
+  vf->link.mrrs = pf->link.mrrs;
+  update_exp_cap(vf);
+
+  pf->vfs[fn] = vf;
+
+  return 0;
+}
+
 int pcie_set_bar
 (
  pcie_dev_t* dev,
@@ -88,165 +363,1543 @@ int pcie_set_bar
 {
   /* size in bytes. must be a power of 2. */
 
+  if (ibar >= PCIE_BAR_COUNT) return -1;
+
   dev->bar_size[ibar] = size;
   dev->bar_readfn[ibar] = on_read;
   dev->bar_writefn[ibar] = on_write;
   dev->bar_data[ibar] = data;
 
+  /* replaces a previous regmap or memory, whose setters set them after */
+  dev->bar_regmap[ibar] = NULL;
+  dev->bar_mem[ibar] = NULL;
+
   return 0;
 }
 
-int pcie_add_task
-(pcie_dev_t* dev, unsigned long usecs, pcie_net_taskfn_t f, void* p)
+int pcie_set_bar_attr
+(
+ pcie_dev_t* dev,
+ unsigned long ibar, uint64_t addr, uint64_t size,
+ unsigned int attr
+)
 {
-  struct timeval tm;
-  tm.tv_sec = usecs / 1000000;
-  tm.tv_usec = usecs % 1000000;
-  return pcie_net_add_task(&dev->net, &tm, f, p);
+  pcie_net_attr_t* a;
+
+  if (ibar >= PCIE_BAR_COUNT) return -1;
+  if (dev->attr_count == PCIE_ATTR_COUNT) return -1;
+
+  a = &dev->attrs[dev->attr_count++];
+  a->attr = (uint8_t)attr;
+  a->bar = (uint8_t)ibar;
+  a->addr = addr;
+  a->size = size;
+
+  return 0;
 }
 
-int pcie_add_event(pcie_dev_t* dev, int fd, pcie_net_evfn_t fn, void* data)
+int pcie_set_doorbell
+(
+ pcie_dev_t* dev,
+ unsigned long ibar, uint64_t addr,
+ pcie_doorbellfn_t fn, void* data
+)
 {
-  return pcie_net_add_ev(&dev->net, fd, fn, data);
-}
+  pcie_doorbell_t* db;
 
-/* device main loop routine */
+  if (dev->doorbell_count == PCIE_DOORBELL_COUNT) return -1;
+  if (pcie_set_bar_attr(dev, ibar, addr, 4, PCIE_NET_ATTR_DOORBELL))
+    return -1;
 
-static void on_write_config(pcie_dev_t* dev, const pcie_net_msg_t* msg)
-{
-  /* writing a bar register requires special handling.
-     non decoded (ie. low bits) must be cleared if set.
-     this scheme is used to probe the BAR size.
-   */
+  db = &dev->doorbells[dev->doorbell_count++];
+  db->dev = dev;
+  db->bar = (unsigned int)ibar;
+  db->addr = addr;
+  db->fn = fn;
+  db->data = data;
+  db->fd = -1;
 
-  if ((msg->addr >= PCI_BASE_ADDRESS_0) && (msg->addr <= PCI_BASE_ADDRESS_5))
-  {
-    const unsigned int ibar =
-      (msg->addr - PCI_BASE_ADDRESS_0) / sizeof(uint32_t);
+  return 0;
+}
 
-    uint32_t data = *(uint32_t*)msg->data;
-    const uint32_t size = dev->bar_size[ibar];
+static pcie_doorbell_t* find_doorbell
+(pcie_dev_t* dev, unsigned int bar, uint64_t addr)
+{
+  size_t i;
 
-    if (data == (uint32_t)-1)
-    {
-      /* probe the bar size */
-      if (dev->bar_size[ibar])
-      {
-	const uint32_t data = *(uint32_t*)msg->data;
-	pcie_write_config_long(dev, msg->addr, data & ~(size - 1));
-      }
-      return ;
-    }
-    /* else, standard write */
-  }
-  else if (msg->addr == PCI_ROM_ADDRESS)
+  for (i = 0; i != dev->doorbell_count; ++i)
   {
-    return ;
+    pcie_doorbell_t* const db = &dev->doorbells[i];
+    if ((db->bar == bar) && (db->addr == (addr & ~(uint64_t)3))) return db;
   }
 
-  /* default write case */
-  switch (msg->width)
+  return NULL;
+}
+
+static void on_doorbell_fd(int fd, void* opak)
+{
+  pcie_doorbell_t* const db = (pcie_doorbell_t*)opak;
+  uint64_t n;
+
+  /* several signals may be merged in the counter */
+  if (read(fd, &n, sizeof(n)) != sizeof(n)) return ;
+
+  db->fn(db->addr, db->data);
+}
+
+static void on_irqfd_map(pcie_dev_t* dev, const pcie_net_msg_t* msg)
+{
+  /* only vector 0 is used, pcie_send_msi has no vector */
+
+  pcie_dev_t* const root = pcie_root(dev);
+  const uint32_t* const vectors = (const uint32_t*)msg->data;
+  const size_t n = msg->size / sizeof(uint32_t);
+  int fds[PCIE_NET_FD_COUNT];
+  size_t nfd;
+  size_t i;
+
+  nfd = pcie_net_take_fds(&root->net, fds, PCIE_NET_FD_COUNT);
+
+  if (dev->msi_fd != -1) close(dev->msi_fd);
+  dev->msi_fd = -1;
+
+  for (i = 0; i != nfd; ++i)
   {
-  case 1: pcie_write_config_byte(dev, msg->addr, *(uint8_t*)msg->data); break ;
-  case 2: pcie_write_config_word(dev, msg->addr, *(uint16_t*)msg->data); break ;
-  case 4: pcie_write_config_long(dev, msg->addr, *(uint32_t*)msg->data); break ;
-  default: break ;
+    if ((i < n) && (vectors[i] == 0) && (dev->msi_fd == -1))
+      dev->msi_fd = fds[i];
+    else
+      close(fds[i]);
   }
 }
 
-static void on_read_config
-(pcie_dev_t* dev, const pcie_net_msg_t* msg, pcie_net_reply_t* reply)
+static void on_doorbell_map(pcie_dev_t* dev, const pcie_net_msg_t* msg)
 {
-  uint64_t data;
+  /* replaces the previous eventfds of the function */
 
-  reply->status = 0;
-  switch (msg->width)
+  pcie_dev_t* const root = pcie_root(dev);
+  const pcie_net_attr_t* const e = (const pcie_net_attr_t*)msg->data;
+  int fds[PCIE_NET_FD_COUNT];
+  size_t nfd;
+  size_t n;
+  size_t i;
+
+  n = msg->size / sizeof(pcie_net_attr_t);
+  nfd = pcie_net_take_fds(&root->net, fds, PCIE_NET_FD_COUNT);
+
+  close_doorbells(dev);
+
+  for (i = 0; i != nfd; ++i)
   {
-  case 1: data = (uint64_t)pcie_read_config_byte(dev, msg->addr); break ;
-  case 2: data = (uint64_t)pcie_read_config_word(dev, msg->addr); break ;
-  case 4: data = (uint64_t)pcie_read_config_long(dev, msg->addr); break ;
-  default: data = (uint64_t)-1; break ;
-  }
+    pcie_doorbell_t* db = NULL;
 
-  *(uint64_t*)reply->data = data;
+    if (i < n) db = find_doorbell(dev, e[i].bar, e[i].addr);
+
+    if ((db == NULL) || pcie_net_add_fd(&root->net, fds[i], on_doorbell_fd, db))
+    {
+      PERROR();
+      close(fds[i]);
+      continue ;
+    }
+
+    db->fd = fds[i];
+  }
 }
 
-static unsigned int on_msg_recv
+/* register map */
+
+int pcie_init_regmap
 (
- const pcie_net_msg_t* msg,
- pcie_net_reply_t* reply,
- void* opak
+ pcie_regmap_t* map,
+ uint32_t* vals, size_t count,
+ const pcie_reg_t* regs, size_t nregs,
+ void* data
 )
 {
-  pcie_dev_t* const dev = (pcie_dev_t*)opak;
-  unsigned int must_reply = 0;
+  size_t i;
 
-  PRINTF("%s(%u, 0x%lx, %u, %x)\n", __FUNCTION__, msg->op, msg->addr, msg->bar, msg->width);
+  map->descs = malloc(count * sizeof(pcie_reg_t*));
+  if (map->descs == NULL) return -1;
 
-  switch (msg->op)
+  map->count = count;
+  map->vals = vals;
+  map->data = data;
+
+  for (i = 0; i < count; ++i) map->descs[i] = NULL;
+
+  for (i = 0; i < nregs; ++i)
   {
-  case PCIE_NET_OP_READ_CONFIG:
-    {
-      on_read_config(dev, msg, reply);
-      must_reply = 1;
-      break ;
-    }
+    const pcie_reg_t* const r = &regs[i];
+    const size_t j = r->addr / sizeof(uint32_t);
 
-  case PCIE_NET_OP_WRITE_CONFIG:
-    {
-      on_write_config(dev, msg);
-      break ;
-    }
+    if ((r->addr & (sizeof(uint32_t) - 1)) || (j >= count)) goto on_error;
 
-  case PCIE_NET_OP_READ_MEM:
-    must_reply = 1;
-    reply->status = 0;
-    *(uint64_t*)reply->data = (uint64_t)-1;
-    if (msg->bar >= PCIE_BAR_COUNT) break ;
-    if (dev->bar_readfn[msg->bar] == NULL) break ;
-    *(uint64_t*)reply->data = 0; /* remove bits due to (uint64_t)-1 */
-    dev->bar_readfn[msg->bar]
-      (msg->addr, (void*)reply->data, msg->width, dev->bar_data[msg->bar]);
-    break ;
+    /* an action without a handler is a model bug */
+    if ((r->flags & PCIE_REG_ACTION) && (r->on_write == NULL)) goto on_error;
 
-  case PCIE_NET_OP_WRITE_MEM:
-    if (msg->bar >= PCIE_BAR_COUNT) break ;
-    if (dev->bar_writefn[msg->bar] == NULL) break ;
-    dev->bar_writefn[msg->bar]
-      (msg->addr, (void*)msg->data, msg->width, dev->bar_data[msg->bar]);
-    break ;
+    map->descs[j] = r;
+  }
 
-  case PCIE_NET_OP_READ_IO:
-    /* TODO: not implemented */
-    reply->status = 0;
-    *(uint64_t*)reply->data = (uint64_t)-1;
-    must_reply = 1;
-    break ;
+  pcie_reset_regmap(map);
 
-  case PCIE_NET_OP_WRITE_IO:
-    /* TODO: not implemented */
-    break ;
+  return 0;
 
-  default:
-    break ;
-  }
+ on_error:
+  PERROR();
+  free(map->descs);
+  map->descs = NULL;
+  return -1;
+}
 
-  return must_reply;
+void pcie_fini_regmap(pcie_regmap_t* map)
+{
+  free(map->descs);
+  map->descs = NULL;
 }
 
-int pcie_loop(pcie_dev_t* dev)
+void pcie_reset_regmap(pcie_regmap_t* map)
 {
-  return pcie_net_loop(&dev->net, on_msg_recv, dev);
+  size_t i;
+
+  for (i = 0; i < map->count; ++i)
+  {
+    const pcie_reg_t* const r = map->descs[i];
+    map->vals[i] = (r == NULL) ? (uint32_t)-1 : r->reset;
+  }
 }
 
-int pcie_send_msi(pcie_dev_t* dev)
+int pcie_set_bar_regmap
+(pcie_dev_t* dev, unsigned long ibar, size_t size, pcie_regmap_t* map)
 {
-  uint8_t buf[offsetof(pcie_net_msg_t, data) + sizeof(uint64_t)];
-  pcie_net_msg_t* const msg = (pcie_net_msg_t*)buf;
+  /* the regmap is served by the runtime, no bar callback */
+  if (pcie_set_bar(dev, ibar, size, NULL, NULL, map->data)) return -1;
+  dev->bar_regmap[ibar] = map;
+  return 0;
+}
 
-  msg->op = PCIE_NET_OP_MSI;
-  msg->size = sizeof(uint64_t);
-  *(uint64_t*)msg->data = 0;
+/* device memory regions */
+
+int pcie_init_mem
+(pcie_mem_t* mem, uint64_t size, const char* path, unsigned int flags)
+{
+  void* p;
+
+  mem->fd = -1;
+  mem->size = size;
+
+  if (path == NULL)
+  {
+    /* pages are allocated on first touch */
+    p = mmap
+    (
+     NULL, size, PROT_READ | PROT_WRITE,
+     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+    );
+  }
+  else
+  {
+    /* sparse file, holes read as zeros */
+    mem->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (mem->fd == -1) goto on_error;
+    if (ftruncate(mem->fd, size)) goto on_error;
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem->fd, 0);
+  }
+
+  if (p == MAP_FAILED) goto on_error;
+
+  mem->base = p;
+
+#ifdef MADV_HUGEPAGE
+  if (flags & PCIE_MEM_HUGEPAGE)
+  {
+    /* advisory only, not an error if unsupported */
+    if (madvise(p, size, MADV_HUGEPAGE)) PERROR();
+  }
+#endif
+
+  return 0;
 
-  return pcie_net_send_msg(&dev->net, msg);
+ on_error:
+  PERROR();
+  if (mem->fd != -1) close(mem->fd);
+  mem->fd = -1;
+  mem->base = NULL;
+  return -1;
+}
+
+void pcie_fini_mem(pcie_mem_t* mem)
+{
+  if (mem->base != NULL) munmap(mem->base, mem->size);
+  if (mem->fd != -1) close(mem->fd);
+  mem->base = NULL;
+  mem->fd = -1;
+}
+
+int pcie_set_bar_mem(pcie_dev_t* dev, unsigned long ibar, pcie_mem_t* mem)
+{
+  if ((ibar + 1) >= PCIE_BAR_COUNT) return -1;
+  if ((mem->size < 0x10) || (mem->size & (mem->size - 1))) return -1;
+
+  pcie_set_bar(dev, ibar, mem->size, NULL, NULL, mem);
+  dev->bar_mem[ibar] = mem;
+  dev->bar_type[ibar] =
+    PCI_BASE_ADDRESS_MEM_TYPE_64 | PCI_BASE_ADDRESS_MEM_PREFETCH;
+
+  /* upper half */
+  pcie_set_bar(dev, ibar + 1, 0, NULL, NULL, NULL);
+
+  pcie_write_config_long
+    (dev, PCI_BASE_ADDRESS_0 + ibar * sizeof(uint32_t), dev->bar_type[ibar]);
+
+  return 0;
+}
+
+int pcie_dma_write_mem
+(
+ pcie_dev_t* dev,
+ uint64_t addr, const pcie_mem_t* mem, uint64_t off, size_t size,
+ unsigned int flags
+)
+{
+  struct iovec iov;
+
+  if ((off > mem->size) || (size > (mem->size - off))) return -1;
+
+  iov.iov_base = pcie_mem_at(mem, off);
+  iov.iov_len = size;
+
+  return pcie_dma_write(dev, addr, &iov, 1, flags);
+}
+
+static inline uint32_t regmap_read_one(pcie_regmap_t* map, size_t i)
+{
+  const pcie_reg_t* const r = map->descs[i];
+  if (r == NULL) return (uint32_t)-1;
+  if (r->on_read == NULL) return map->vals[i];
+  return r->on_read((unsigned int)i, map->data);
+}
+
+static inline void regmap_store
+(pcie_regmap_t* map, size_t i, uint32_t x, uint32_t mask)
+{
+  const pcie_reg_t* const r = map->descs[i];
+
+  if (r == NULL) return ;
+
+  if (r->flags & PCIE_REG_W1C)
+    map->vals[i] &= ~(x & mask);
+  else if (r->flags & (PCIE_REG_RW | PCIE_REG_ACTION))
+    map->vals[i] = (map->vals[i] & ~mask) | (x & mask);
+}
+
+static void regmap_read
+(pcie_regmap_t* map, uint64_t addr, uint8_t* data, size_t size)
+{
+  size_t i = addr / sizeof(uint32_t);
+  size_t off = addr % sizeof(uint32_t);
+
+  /* common case, aligned 32 bits access */
+  if ((off == 0) && (size == sizeof(uint32_t)) && (i < map->count))
+  {
+    *(uint32_t*)data = regmap_read_one(map, i);
+    return ;
+  }
+
+  while (size)
+  {
+    size_t n = sizeof(uint32_t) - off;
+    uint32_t x = (uint32_t)-1;
+
+    if (n > size) n = size;
+    if (i < map->count) x = regmap_read_one(map, i);
+    memcpy(data, (const uint8_t*)&x + off, n);
+
+    data += n;
+    size -= n;
+    off = 0;
+    ++i;
+  }
+}
+
+static inline void regmap_notify(pcie_regmap_t* map, size_t i)
+{
+  /* on_write hook of a writable register */
+
+  const pcie_reg_t* const r = map->descs[i];
+
+  if ((r == NULL) || (r->on_write == NULL)) return ;
+  if ((r->flags & (PCIE_REG_W1C | PCIE_REG_RW | PCIE_REG_ACTION)) == 0) return ;
+
+  r->on_write((unsigned int)i, map->vals[i], map->data);
+}
+
+static void regmap_write
+(pcie_regmap_t* map, uint64_t addr, const uint8_t* data, size_t size)
+{
+  /* an access covering several registers, such as a 64 bits one, stores
+     them all before the hooks run. hooks see the register pair whole.
+   */
+
+  size_t i = addr / sizeof(uint32_t);
+  size_t off = addr % sizeof(uint32_t);
+  const size_t first = i;
+  size_t last;
+
+  if ((off == 0) && (size == sizeof(uint32_t)))
+  {
+    if (i >= map->count) return ;
+    regmap_store(map, i, *(const uint32_t*)data, (uint32_t)-1);
+    regmap_notify(map, i);
+    return ;
+  }
+
+  last = (addr + size + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+  if (last > map->count) last = map->count;
+
+  while (size)
+  {
+    size_t n = sizeof(uint32_t) - off;
+    uint32_t x = 0;
+    uint32_t mask = 0;
+
+    if (n > size) n = size;
+    memcpy((uint8_t*)&x + off, data, n);
+    memset((uint8_t*)&mask + off, 0xff, n);
+    if (i < map->count) regmap_store(map, i, x, mask);
+
+    data += n;
+    size -= n;
+    off = 0;
+    ++i;
+  }
+
+  for (i = first; i < last; ++i) regmap_notify(map, i);
+}
+
+int pcie_set_link
+(
+ pcie_dev_t* dev,
+ unsigned int gen, unsigned int width,
+ unsigned int mps, unsigned int mrrs
+)
+{
+  /* gen 1 and 2 use 8b/10b, gen 3 uses 128b/130b encoding */
+  static const double lane_rates[] = { 0.25, 0.5, 8.0 / 8.0 * 128 / 130 };
+
+  pcie_link_t* const link = &dev->link;
+
+  if (gen == 0)
+  {
+    link->gen = 0;
+    update_exp_cap(dev);
+    return 0;
+  }
+
+  if ((gen > 3) || (is_link_width(width) == 0)) return -1;
+  if ((mps < 128) || (mps > 4096) || (mps & (mps - 1))) return -1;
+  if ((mrrs < 128) || (mrrs > 4096) || (mrrs & (mrrs - 1))) return -1;
+
+  link->gen = gen;
+  link->width = width;
+  link->mps = mps;
+  link->mrrs = mrrs;
+  link->latency = 250;
+  link->rate = lane_rates[gen - 1] * (double)width;
+
+  /* 64 bits address header (16), sequence (2), lcrc (4) and framing.
+     framing is 2 bytes in gen 1 and 2, a 4 bytes token in gen 3.
+   */
+  link->tlp_overhead = 16 + 2 + 4 + ((gen == 3) ? 4 : 2);
+
+  link->busy_ns = 0;
+
+  update_exp_cap(dev);
+
+  return 0;
+}
+
+int pcie_add_task
+(pcie_dev_t* dev, unsigned long usecs, pcie_net_taskfn_t f, void* p)
+{
+  struct timeval tm;
+  tm.tv_sec = usecs / 1000000;
+  tm.tv_usec = usecs % 1000000;
+  return pcie_net_add_task(&pcie_root(dev)->net, &tm, f, p);
+}
+
+int pcie_add_event(pcie_dev_t* dev, int fd, pcie_net_evfn_t fn, void* data)
+{
+  return pcie_net_add_ev(&pcie_root(dev)->net, fd, fn, data);
+}
+
+/* device main loop routine */
+
+static void on_write_config(pcie_dev_t* dev, const pcie_net_msg_t* msg)
+{
+  /* writing a bar register requires special handling.
+     non decoded (ie. low bits) must be cleared if set.
+     this scheme is used to probe the BAR size.
+   */
+
+  if ((msg->addr >= PCI_BASE_ADDRESS_0) && (msg->addr <= PCI_BASE_ADDRESS_5))
+  {
+    const unsigned int ibar =
+      (msg->addr - PCI_BASE_ADDRESS_0) / sizeof(uint32_t);
+
+    uint32_t data = *(uint32_t*)msg->data;
+    uint64_t size = dev->bar_size[ibar];
+
+    if (ibar && (dev->bar_type[ibar - 1] & PCI_BASE_ADDRESS_MEM_TYPE_64))
+    {
+      /* upper half of a 64 bits bar */
+      size = dev->bar_size[ibar - 1];
+      if (data == (uint32_t)-1)
+	pcie_write_config_long(dev, msg->addr, (uint32_t)(~(size - 1) >> 32));
+      else
+	pcie_write_config_long(dev, msg->addr, data);
+      return ;
+    }
+
+    if (data == (uint32_t)-1)
+    {
+      /* probe the bar size */
+      if (size)
+      {
+	data = ((uint32_t)~(size - 1)) | dev->bar_type[ibar];
+	pcie_write_config_long(dev, msg->addr, data);
+      }
+      return ;
+    }
+
+    if (dev->bar_type[ibar])
+    {
+      /* keep the type bits */
+      data = (data & ~0xf) | dev->bar_type[ibar];
+      pcie_write_config_long(dev, msg->addr, data);
+      return ;
+    }
+
+    /* else, standard write */
+  }
+  else if (msg->addr == PCI_ROM_ADDRESS)
+  {
+    return ;
+  }
+
+  /* default write case */
+  switch (msg->width)
+  {
+  case 1: pcie_write_config_byte(dev, msg->addr, *(uint8_t*)msg->data); break ;
+  case 2: pcie_write_config_word(dev, msg->addr, *(uint16_t*)msg->data); break ;
+  case 4: pcie_write_config_long(dev, msg->addr, *(uint32_t*)msg->data); break ;
+  default: break ;
+  }
+
+  if ((msg->addr <= (EXP_CAP_OFF + PCI_EXP_DEVCTL)) &&
+      ((msg->addr + msg->width) > (EXP_CAP_OFF + PCI_EXP_DEVCTL)))
+    on_write_devctl(dev);
+}
+
+static void on_read_config
+(pcie_dev_t* dev, const pcie_net_msg_t* msg, pcie_net_reply_t* reply)
+{
+  uint64_t data;
+
+  reply->status = 0;
+  switch (msg->width)
+  {
+  case 1: data = (uint64_t)pcie_read_config_byte(dev, msg->addr); break ;
+  case 2: data = (uint64_t)pcie_read_config_word(dev, msg->addr); break ;
+  case 4: data = (uint64_t)pcie_read_config_long(dev, msg->addr); break ;
+  default: data = (uint64_t)-1; break ;
+  }
+
+  *(uint64_t*)reply->data = data;
+}
+
+static void on_probe(pcie_dev_t* root, unsigned int fn, pcie_dev_t* dev)
+{
+  /* config image, bar attributes and probe summary, in one system
+     call. a missing function reads all ones.
+   */
+
+  const size_t config_size = sizeof(dev->config);
+  const size_t attr_size = sizeof(dev->attrs);
+  pcie_net_msg_t* const cm = pcie_net_alloc_msg(config_size);
+  pcie_net_msg_t* const am = pcie_net_alloc_msg(attr_size);
+  pcie_net_msg_t* const dm = pcie_net_alloc_msg(sizeof(pcie_net_probe_t));
+  pcie_net_probe_t* probe;
+  struct iovec iov[3];
+  unsigned int i;
+
+  if ((cm == NULL) || (am == NULL) || (dm == NULL)) { PERROR(); goto on_error; }
+
+  probe = (pcie_net_probe_t*)dm->data;
+
+  cm->header.size = offsetof(pcie_net_msg_t, data) + config_size;
+  cm->op = PCIE_NET_OP_PROBE_CONFIG;
+  cm->bar = fn << PCIE_NET_FUNC_SHIFT;
+  cm->width = 0;
+  cm->addr = 0;
+  cm->size = (uint16_t)config_size;
+
+  am->op = PCIE_NET_OP_PROBE_ATTR;
+  am->bar = fn << PCIE_NET_FUNC_SHIFT;
+  am->width = 0;
+  am->addr = 0;
+  am->size = 0;
+
+  dm->header.size = offsetof(pcie_net_msg_t, data) + sizeof(*probe);
+  dm->op = PCIE_NET_OP_PROBE_DONE;
+  dm->bar = fn << PCIE_NET_FUNC_SHIFT;
+  dm->width = 0;
+  dm->addr = 0;
+  dm->size = sizeof(*probe);
+
+  memset(probe, 0, sizeof(*probe));
+
+  if (dev == NULL)
+  {
+    memset(cm->data, 0xff, config_size);
+  }
+  else
+  {
+    memcpy(cm->data, dev->config, config_size);
+    memcpy(probe->volatile_map, dev->config_volatile, sizeof(dev->config_volatile));
+
+    am->size = (uint16_t)(dev->attr_count * sizeof(pcie_net_attr_t));
+    memcpy(am->data, dev->attrs, am->size);
+
+    for (i = 0; i < PCIE_BAR_COUNT; ++i)
+    {
+      const uint64_t size = dev->bar_size[i];
+      if (size == 0) continue ;
+      probe->bar_mask[i] = ((uint32_t)~(size - 1)) | dev->bar_type[i];
+      if ((dev->bar_type[i] & PCI_BASE_ADDRESS_MEM_TYPE_64) == 0) continue ;
+      if ((i + 1) == PCIE_BAR_COUNT) break ;
+      probe->bar_mask[++i] = (uint32_t)(~(size - 1) >> 32);
+    }
+  }
+
+  am->header.size = offsetof(pcie_net_msg_t, data) + am->size;
+
+  iov[0].iov_base = (void*)cm;
+  iov[0].iov_len = cm->header.size;
+  iov[1].iov_base = (void*)am;
+  iov[1].iov_len = am->header.size;
+  iov[2].iov_base = (void*)dm;
+  iov[2].iov_len = dm->header.size;
+  if (pcie_net_send_iov(&root->net, iov, 3)) PERROR();
+
+ on_error:
+  if (cm != NULL) pcie_net_free_buf(cm);
+  if (am != NULL) pcie_net_free_buf(am);
+  if (dm != NULL) pcie_net_free_buf(dm);
+}
+
+/* shared host memory */
+
+static void unmap_host_mem(pcie_dev_t* root)
+{
+  size_t i;
+
+  for (i = 0; i != root->host_map_count; ++i)
+  {
+    pcie_host_map_t* const m = &root->host_maps[i];
+    munmap(m->map, m->map_size);
+  }
+
+  root->host_map_count = 0;
+}
+
+static void on_mem_map(pcie_dev_t* root, const pcie_net_msg_t* msg)
+{
+  const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  const pcie_net_mem_map_t* const e = (const pcie_net_mem_map_t*)msg->data;
+  int fds[PCIE_HOST_MAP_COUNT];
+  size_t nfd;
+  size_t n;
+  size_t i;
+
+  n = msg->size / sizeof(pcie_net_mem_map_t);
+  nfd = pcie_net_take_fds(&root->net, fds, PCIE_HOST_MAP_COUNT);
+
+  unmap_host_mem(root);
+
+  for (i = 0; i != n; ++i)
+  {
+    pcie_host_map_t* const m = &root->host_maps[root->host_map_count];
+    const uint64_t off = e[i].off & ~((uint64_t)page_size - 1);
+
+    if (i >= nfd) { PERROR(); break ; }
+
+    m->map_size = (size_t)(e[i].off - off + e[i].size);
+    m->map = mmap
+      (NULL, m->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], off);
+    if (m->map == MAP_FAILED) { PERROR(); continue ; }
+
+    m->addr = e[i].addr;
+    m->size = e[i].size;
+    m->base = (uint8_t*)m->map + (e[i].off - off);
+    ++root->host_map_count;
+  }
+
+  /* mappings hold their own reference */
+  for (i = 0; i != nfd; ++i) close(fds[i]);
+}
+
+static void on_peer_close(void* opak)
+{
+  /* the host memory, doorbells and irqfds went with the host. the next
+     one maps them again when it probes.
+   */
+
+  pcie_dev_t* const root = (pcie_dev_t*)opak;
+  size_t i;
+
+  for (i = 0; i != PCIE_FUNC_COUNT; ++i)
+  {
+    pcie_dev_t* const dev = (i == 0) ? root : root->vfs[i];
+    if (dev == NULL) continue ;
+
+    dma_cancel_all(dev);
+    close_doorbells(dev);
+    if (dev->msi_fd != -1) close(dev->msi_fd);
+    dev->msi_fd = -1;
+    dev->has_posted = 0;
+  }
+
+  /* their completions will never come */
+  atomic_cancel_all(root);
+
+  unmap_host_mem(root);
+}
+
+static const pcie_host_map_t* find_host_map
+(pcie_dev_t* root, uint64_t addr, size_t size)
+{
+  size_t i;
+
+  for (i = 0; i != root->host_map_count; ++i)
+  {
+    const pcie_host_map_t* const m = &root->host_maps[i];
+    if ((addr >= m->addr) && ((addr + size) <= (m->addr + m->size)))
+      return m;
+  }
+
+  return NULL;
+}
+
+void* pcie_host_mem(pcie_dev_t* dev, uint64_t addr, size_t size)
+{
+  const pcie_host_map_t* const m = find_host_map(pcie_root(dev), addr, size);
+  if (m == NULL) return NULL;
+  return m->base + (addr - m->addr);
+}
+
+int pcie_sync_host_mem(pcie_dev_t* dev, uint64_t addr, size_t size)
+{
+  /* counters and link model see the mps sized TLPs of a regular write */
+
+  uint8_t buf[offsetof(pcie_net_msg_t, data) + sizeof(uint64_t)];
+  pcie_net_msg_t* const msg = (pcie_net_msg_t*)buf;
+  pcie_dev_t* const root = pcie_root(dev);
+
+  STATS_ADD(dev, tx_tlps, (size + dev->link.mps - 1) / dev->link.mps);
+  STATS_ADD(dev, tx_bytes, size);
+
+  if (root->link.gen) link_send(dev, size);
+
+  msg->op = PCIE_NET_OP_MEM_SYNC;
+  msg->bar = dev->fn << PCIE_NET_FUNC_SHIFT;
+  msg->width = 0;
+  msg->addr = addr;
+  msg->size = sizeof(uint64_t);
+  *(uint64_t*)msg->data = (uint64_t)size;
+
+  return pcie_net_send_msg(&root->net, msg);
+}
+
+static void on_atomic_cpl(pcie_dev_t*, const pcie_net_msg_t*);
+
+static unsigned int on_msg_recv
+(
+ const pcie_net_msg_t* msg,
+ pcie_net_reply_t* reply,
+ void* opak
+)
+{
+  pcie_dev_t* const root = (pcie_dev_t*)opak;
+  const unsigned int bar = msg->bar & PCIE_NET_BAR_MASK;
+  const unsigned int fn = msg->bar >> PCIE_NET_FUNC_SHIFT;
+  pcie_dev_t* dev = root;
+  unsigned int must_reply = 0;
+  uint64_t recv_ns = 0;
+
+  if (root->link.gen) recv_ns = pcie_net_get_ns(&root->net);
+
+  PRINTF("%s(%u, 0x%lx, %u, %x)\n", __FUNCTION__, msg->op, msg->addr, msg->bar, msg->width);
+
+  /* the bar field holds the status, not a function */
+  if (msg->op == PCIE_NET_OP_ATOMIC_CPL)
+  {
+    on_atomic_cpl(root, msg);
+    return 0;
+  }
+
+  if (fn != 0)
+  {
+    dev = root->vfs[fn];
+    if (dev == NULL)
+    {
+      if (msg->op == PCIE_NET_OP_PROBE)
+      {
+	on_probe(root, fn, NULL);
+	return 0;
+      }
+
+      /* no such function, unsupported request */
+      reply->status = 0;
+      *(uint64_t*)reply->data = (uint64_t)-1;
+      return (msg->op <= PCIE_NET_OP_READ_IO) && ((msg->op & 1) == 0);
+    }
+  }
+
+  if (msg->op <= PCIE_NET_OP_WRITE_IO)
+  {
+    STATS_ADD(dev, rx_tlps, 1);
+    if ((msg->op & 1) == 0)
+    {
+      /* read completion with data */
+      STATS_ADD(dev, tx_tlps, 1);
+      STATS_ADD(dev, tx_bytes, msg->width);
+    }
+    else
+    {
+      /* a memory write can be a burst of several accesses */
+      STATS_ADD(dev, rx_bytes, msg->size);
+      /* config and io writes are non posted */
+      if (msg->op != PCIE_NET_OP_WRITE_MEM) STATS_ADD(dev, tx_tlps, 1);
+    }
+  }
+
+  switch (msg->op)
+  {
+  case PCIE_NET_OP_READ_CONFIG:
+    {
+      on_read_config(dev, msg, reply);
+      must_reply = 1;
+      break ;
+    }
+
+  case PCIE_NET_OP_WRITE_CONFIG:
+    {
+      on_write_config(dev, msg);
+      break ;
+    }
+
+  case PCIE_NET_OP_READ_MEM:
+    if (root->link.gen) link_complete(dev, recv_ns, msg->width);
+    must_reply = 1;
+    reply->status = 0;
+    *(uint64_t*)reply->data = (uint64_t)-1;
+    /* 1, 2, 4 or 8 bytes, the reply holds the value in the low bytes */
+    if ((bar >= PCIE_BAR_COUNT) || (msg->width > sizeof(reply->data))) break ;
+    if (dev->bar_mem[bar] != NULL)
+    {
+      const pcie_mem_t* const mem = dev->bar_mem[bar];
+      if ((msg->addr + msg->width) > mem->size) break ;
+      memcpy(reply->data, pcie_mem_at(mem, msg->addr), msg->width);
+      break ;
+    }
+    if (dev->bar_regmap[bar] != NULL)
+    {
+      regmap_read(dev->bar_regmap[bar], msg->addr, reply->data, msg->width);
+      break ;
+    }
+    if (dev->bar_readfn[bar] == NULL) break ;
+    *(uint64_t*)reply->data = 0; /* remove bits due to (uint64_t)-1 */
+    dev->bar_readfn[bar]
+      (msg->addr, (void*)reply->data, msg->width, dev->bar_data[bar]);
+    break ;
+
+  case PCIE_NET_OP_WRITE_MEM:
+    /* size is a multiple of width for combined writes, delivered in
+       one call. it equals width otherwise.
+     */
+    if (bar >= PCIE_BAR_COUNT) break ;
+    if (dev->doorbell_count)
+    {
+      pcie_doorbell_t* const db = find_doorbell(dev, bar, msg->addr);
+      if (db != NULL)
+      {
+	db->fn(db->addr, db->data);
+	break ;
+      }
+    }
+    if (dev->bar_mem[bar] != NULL)
+    {
+      const pcie_mem_t* const mem = dev->bar_mem[bar];
+      if ((msg->addr + msg->size) > mem->size) break ;
+      memcpy(pcie_mem_at(mem, msg->addr), msg->data, msg->size);
+      break ;
+    }
+    if (dev->bar_regmap[bar] != NULL)
+    {
+      regmap_write(dev->bar_regmap[bar], msg->addr, msg->data, msg->size);
+      break ;
+    }
+    if (dev->bar_writefn[bar] == NULL) break ;
+    dev->bar_writefn[bar]
+      (msg->addr, (void*)msg->data, msg->size, dev->bar_data[bar]);
+    break ;
+
+  case PCIE_NET_OP_READ_IO:
+    /* TODO: not implemented */
+    reply->status = 0;
+    *(uint64_t*)reply->data = (uint64_t)-1;
+    must_reply = 1;
+    break ;
+
+  case PCIE_NET_OP_WRITE_IO:
+    /* TODO: not implemented */
+    break ;
+
+  case PCIE_NET_OP_PROBE:
+    on_probe(root, fn, dev);
+    break ;
+
+  case PCIE_NET_OP_MEM_MAP:
+    on_mem_map(root, msg);
+    break ;
+
+  case PCIE_NET_OP_DOORBELL_MAP:
+    on_doorbell_map(dev, msg);
+    break ;
+
+  case PCIE_NET_OP_IRQFD_MAP:
+    on_irqfd_map(dev, msg);
+    break ;
+
+  default:
+    break ;
+  }
+
+  return must_reply;
+}
+
+int pcie_loop(pcie_dev_t* dev)
+{
+  pcie_net_set_close(&dev->net, on_peer_close, dev);
+  return pcie_net_loop(&dev->net, on_msg_recv, dev);
+}
+
+static int send_tlp(pcie_dev_t* dev, pcie_net_msg_t* msg)
+{
+  /* interrupts are header only TLPs */
+  const size_t size =
+    ((msg->op == PCIE_NET_OP_WRITE_MEM) ||
+     ((msg->op >= PCIE_NET_OP_ATOMIC_FETCHADD) &&
+      (msg->op <= PCIE_NET_OP_ATOMIC_CAS))) ? msg->size : 0;
+
+  pcie_dev_t* const root = pcie_root(dev);
+
+  /* device initiated, the requester function is in the bar field */
+  msg->bar = dev->fn << PCIE_NET_FUNC_SHIFT;
+
+  STATS_ADD(dev, tx_tlps, 1);
+  STATS_ADD(dev, tx_bytes, size);
+
+  if (msg->op == PCIE_NET_OP_WRITE_MEM) __sync_fetch_and_or(&dev->has_posted, 1);
+
+  if (root->link.gen) link_send(dev, size);
+
+  return pcie_net_send_msg(&root->net, msg);
+}
+
+int pcie_send_msi(pcie_dev_t* dev)
+{
+  uint8_t buf[offsetof(pcie_net_msg_t, data) + sizeof(uint64_t)];
+  pcie_net_msg_t* const msg = (pcie_net_msg_t*)buf;
+
+  /* the irqfd bypasses the host loop. it is used only if no memory
+     write message was sent since the last msi, as the host could
+     still be processing it when the interrupt arrives. the flag is
+     tested and cleared at once, a lane may be writing.
+   */
+  const unsigned int has_posted = __sync_fetch_and_and(&dev->has_posted, 0);
+
+  if ((dev->msi_fd != -1) && (has_posted == 0))
+  {
+    pcie_dev_t* const root = pcie_root(dev);
+    const uint64_t x = 1;
+
+    STATS_ADD(dev, tx_tlps, 1);
+    if (root->link.gen) link_send(dev, 0);
+
+    if (write(dev->msi_fd, &x, sizeof(x)) != sizeof(x)) { PERROR(); return -1; }
+    return 0;
+  }
+
+  msg->op = PCIE_NET_OP_MSI;
+  msg->size = sizeof(uint64_t);
+  *(uint64_t*)msg->data = 0;
+
+  /* the msi message keeps the order with the writes */
+  return send_tlp(dev, msg);
+}
+
+int pcie_send_msg(pcie_dev_t* dev, pcie_net_msg_t* msg)
+{
+  if (msg->op == PCIE_NET_OP_MSI) return pcie_send_msi(dev);
+
+  if ((msg->op != PCIE_NET_OP_WRITE_MEM) || (msg->size <= dev->link.mps))
+    return send_tlp(dev, msg);
+
+  /* larger than mps, split */
+  return pcie_write_mem(dev, msg->addr, msg->data, msg->size);
+}
+
+int pcie_write_mem
+(pcie_dev_t* dev, uint64_t addr, const void* data, size_t size)
+{
+  struct iovec iov;
+  iov.iov_base = (void*)data;
+  iov.iov_len = size;
+  return pcie_dma_write(dev, addr, &iov, 1, 0);
+}
+
+/* atomic operations. the host completes them in order on the main
+   connection, the pending requests are queued on the physical function
+   in the same order.
+ */
+
+typedef struct pcie_atomic_req
+{
+  struct pcie_atomic_req* next;
+  /* requester, for the counters */
+  pcie_dev_t* dev;
+  pcie_atomic_donefn_t fn;
+  void* data;
+} pcie_atomic_req_t;
+
+static pcie_atomic_req_t* atomic_pop_req(pcie_dev_t* root)
+{
+  pcie_atomic_req_t* req;
+
+  pcie_net_lock(&root->net);
+  req = root->atomic_head;
+  if (req != NULL)
+  {
+    root->atomic_head = req->next;
+    if (root->atomic_head == NULL) root->atomic_tail = NULL;
+  }
+  pcie_net_unlock(&root->net);
+
+  return req;
+}
+
+static void on_atomic_cpl(pcie_dev_t* root, const pcie_net_msg_t* msg)
+{
+  /* loop thread, complete the oldest request */
+
+  pcie_atomic_req_t* const req = atomic_pop_req(root);
+  uint64_t old = 0;
+
+  if (req == NULL) { PERROR(); return ; }
+
+  STATS_ADD(req->dev, rx_tlps, 1);
+  STATS_ADD(req->dev, rx_bytes, msg->width);
+
+  memcpy(&old, msg->data, msg->width <= 8 ? msg->width : 8);
+
+  if (req->fn != NULL) req->fn((msg->bar == 0) ? 0 : -1, old, req->data);
+
+  pcie_net_free_buf(req);
+}
+
+static void atomic_cancel_all(pcie_dev_t* root)
+{
+  pcie_atomic_req_t* req;
+
+  while ((req = atomic_pop_req(root)) != NULL)
+  {
+    if (req->fn != NULL) req->fn(-1, 0, req->data);
+    pcie_net_free_buf(req);
+  }
+}
+
+static void atomic_orphan_all(pcie_dev_t* dev)
+{
+  /* a virtual function goes away. its requests stay queued so that the
+     completions still match, but they are no longer reported.
+   */
+
+  pcie_dev_t* const root = pcie_root(dev);
+  pcie_atomic_req_t* req;
+
+  pcie_net_lock(&root->net);
+  for (req = root->atomic_head; req != NULL; req = req->next)
+  {
+    if (req->dev != dev) continue ;
+    req->dev = root;
+    req->fn = NULL;
+  }
+  pcie_net_unlock(&root->net);
+}
+
+static int send_atomic
+(
+ pcie_dev_t* dev, uint8_t op,
+ uint64_t addr, unsigned int width,
+ uint64_t a, uint64_t b,
+ pcie_atomic_donefn_t fn, void* data
+)
+{
+  uint8_t buf[offsetof(pcie_net_msg_t, data) + 2 * sizeof(uint64_t)];
+  pcie_net_msg_t* const msg = (pcie_net_msg_t*)buf;
+  pcie_dev_t* const root = pcie_root(dev);
+  pcie_atomic_req_t* req;
+  int err;
+
+  if ((width != 4) && (width != 8)) return -1;
+  if (addr & (width - 1)) return -1;
+
+  msg->op = op;
+  msg->bar = 0;
+  msg->width = (uint8_t)width;
+  msg->addr = addr;
+  msg->size = (uint16_t)width;
+  memcpy(msg->data, &a, width);
+
+  if (op == PCIE_NET_OP_ATOMIC_CAS)
+  {
+    msg->size = (uint16_t)(2 * width);
+    memcpy(msg->data + width, &b, width);
+  }
+
+  req = pcie_net_alloc_buf(sizeof(pcie_atomic_req_t));
+  if (req == NULL) return -1;
+
+  req->next = NULL;
+  req->dev = dev;
+  req->fn = fn;
+  req->data = data;
+
+  /* queued in sending order. the completion is popped with the lock
+     held, it cannot be handled before the request is queued.
+   */
+  pcie_net_lock(&root->net);
+
+  err = pcie_send_msg(dev, msg);
+  if (err == 0)
+  {
+    if (root->atomic_tail == NULL) root->atomic_head = req;
+    else root->atomic_tail->next = req;
+    root->atomic_tail = req;
+  }
+
+  pcie_net_unlock(&root->net);
+
+  if (err) pcie_net_free_buf(req);
+
+  return err;
+}
+
+int pcie_atomic_fetch_add_async
+(
+ pcie_dev_t* dev, uint64_t addr, unsigned int width, uint64_t x,
+ pcie_atomic_donefn_t fn, void* data
+)
+{
+  return send_atomic
+    (dev, PCIE_NET_OP_ATOMIC_FETCHADD, addr, width, x, 0, fn, data);
+}
+
+int pcie_atomic_swap_async
+(
+ pcie_dev_t* dev, uint64_t addr, unsigned int width, uint64_t x,
+ pcie_atomic_donefn_t fn, void* data
+)
+{
+  return send_atomic
+    (dev, PCIE_NET_OP_ATOMIC_SWAP, addr, width, x, 0, fn, data);
+}
+
+int pcie_atomic_cas_async
+(
+ pcie_dev_t* dev, uint64_t addr, unsigned int width, uint64_t cmp, uint64_t x,
+ pcie_atomic_donefn_t fn, void* data
+)
+{
+  return send_atomic
+    (dev, PCIE_NET_OP_ATOMIC_CAS, addr, width, cmp, x, fn, data);
+}
+
+/* blocking conveniences, the loop delivers the completion */
+
+typedef struct atomic_wait
+{
+  volatile unsigned int is_done;
+  int err;
+  uint64_t old;
+} atomic_wait_t;
+
+static void on_atomic_wait(int err, uint64_t old, void* opak)
+{
+  atomic_wait_t* const w = (atomic_wait_t*)opak;
+  w->err = err;
+  w->old = old;
+  __sync_synchronize();
+  w->is_done = 1;
+}
+
+static int wait_atomic
+(
+ pcie_dev_t* dev, uint8_t op,
+ uint64_t addr, unsigned int width,
+ uint64_t a, uint64_t b,
+ uint64_t* old
+)
+{
+  atomic_wait_t w;
+
+  /* the loop would never run */
+  if (pcie_net_is_loop_thread(&pcie_root(dev)->net)) { PERROR(); return -1; }
+
+  w.is_done = 0;
+  if (send_atomic(dev, op, addr, width, a, b, on_atomic_wait, &w)) return -1;
+  while (w.is_done == 0) sched_yield();
+  __sync_synchronize();
+
+  if (w.err) return -1;
+  *old = w.old;
+  return 0;
+}
+
+int pcie_atomic_fetch_add
+(pcie_dev_t* dev, uint64_t addr, unsigned int width, uint64_t x, uint64_t* old)
+{
+  return wait_atomic
+    (dev, PCIE_NET_OP_ATOMIC_FETCHADD, addr, width, x, 0, old);
+}
+
+int pcie_atomic_swap
+(pcie_dev_t* dev, uint64_t addr, unsigned int width, uint64_t x, uint64_t* old)
+{
+  return wait_atomic(dev, PCIE_NET_OP_ATOMIC_SWAP, addr, width, x, 0, old);
+}
+
+int pcie_atomic_cas
+(
+ pcie_dev_t* dev,
+ uint64_t addr, unsigned int width,
+ uint64_t cmp, uint64_t x,
+ uint64_t* old
+)
+{
+  return wait_atomic(dev, PCIE_NET_OP_ATOMIC_CAS, addr, width, cmp, x, old);
+}
+
+/* scatter gather dma */
+
+typedef struct dma_cursor
+{
+  /* next host address and device data */
+  uint64_t addr;
+  const struct iovec* iov;
+  size_t iovcnt;
+  size_t off;
+} dma_cursor_t;
+
+static void dma_init_cursor
+(dma_cursor_t* c, uint64_t addr, const struct iovec* iov, size_t iovcnt)
+{
+  c->addr = addr;
+  c->iov = iov;
+  c->iovcnt = iovcnt;
+  c->off = 0;
+}
+
+static inline int dma_is_done(const dma_cursor_t* c)
+{
+  return c->iovcnt == 0;
+}
+
+static int dma_send_direct(pcie_dev_t* dev, dma_cursor_t* c)
+{
+  /* the whole remaining transfer, if it falls in shared host memory.
+     returns 1 if not, the cursor is left untouched.
+   */
+
+  const struct iovec* iov;
+  uint8_t* p;
+  size_t size;
+  size_t off;
+  size_t i;
+
+  size = 0;
+  for (i = 0; i != c->iovcnt; ++i) size += c->iov[i].iov_len;
+  size -= c->off;
+
+  if (size == 0) return 1;
+  p = pcie_host_mem(dev, c->addr, size);
+  if (p == NULL) return 1;
+
+  for (iov = c->iov, off = c->off, i = 0; i != c->iovcnt; ++i, ++iov)
+  {
+    memcpy(p, (const uint8_t*)iov->iov_base + off, iov->iov_len - off);
+    p += iov->iov_len - off;
+    off = 0;
+  }
+
+  c->addr += size;
+  c->iov += c->iovcnt;
+  c->iovcnt = 0;
+  c->off = 0;
+
+  return pcie_sync_host_mem(dev, c->addr - size, size);
+}
+
+static int dma_send_batch(pcie_dev_t* dev, dma_cursor_t* c)
+{
+  /* send up to DMA_BATCH_TLPS messages in one system call. headers are
+     built here, payloads point into the device buffers.
+   */
+
+#define DMA_BATCH_TLPS 32
+#define DMA_BATCH_IOVS 128
+#define DMA_HEADER_SIZE offsetof(pcie_net_msg_t, data)
+
+  uint8_t headers[DMA_BATCH_TLPS][DMA_HEADER_SIZE];
+  struct iovec iovs[DMA_BATCH_IOVS];
+  size_t niov = 0;
+  size_t ntlp = 0;
+  uint64_t now = 0;
+  uint64_t busy = 0;
+  pcie_dev_t* const root = pcie_root(dev);
+
+  if (root->host_map_count)
+  {
+    const int err = dma_send_direct(dev, c);
+    if (err != 1) return err;
+  }
+
+  if (root->link.gen) now = pcie_net_get_ns(&root->net);
+
+  while ((ntlp != DMA_BATCH_TLPS) && (niov < (DMA_BATCH_IOVS - 1)))
+  {
+    pcie_net_msg_t* const m = (pcie_net_msg_t*)headers[ntlp];
+    const size_t hiov = niov++;
+    size_t size = 0;
+
+    /* skip empty buffers */
+    while (c->iovcnt && (c->off == c->iov->iov_len))
+    {
+      ++c->iov;
+      --c->iovcnt;
+      c->off = 0;
+    }
+
+    if (c->iovcnt == 0)
+    {
+      --niov;
+      break ;
+    }
+
+    /* gather up to mps bytes, possibly less if out of iovecs */
+    while (c->iovcnt && (size != dev->link.mps) && (niov != DMA_BATCH_IOVS))
+    {
+      size_t n = c->iov->iov_len - c->off;
+      if (n > (dev->link.mps - size)) n = dev->link.mps - size;
+
+      iovs[niov].iov_base = (uint8_t*)c->iov->iov_base + c->off;
+      iovs[niov].iov_len = n;
+      ++niov;
+
+      size += n;
+      c->off += n;
+
+      if (c->off == c->iov->iov_len)
+      {
+	++c->iov;
+	--c->iovcnt;
+	c->off = 0;
+      }
+    }
+
+    m->header.size = DMA_HEADER_SIZE + size;
+    m->op = PCIE_NET_OP_WRITE_MEM;
+    m->bar = dev->fn << PCIE_NET_FUNC_SHIFT;
+    m->width = 0;
+    m->addr = c->addr;
+    m->size = (uint16_t)size;
+
+    iovs[hiov].iov_base = (void*)m;
+    iovs[hiov].iov_len = DMA_HEADER_SIZE;
+
+    c->addr += size;
+    ++ntlp;
+
+    STATS_ADD(dev, tx_tlps, 1);
+    STATS_ADD(dev, tx_bytes, size);
+    if (root->link.gen) busy = link_queue(dev, now, size);
+  }
+
+  if (ntlp == 0) return 0;
+
+  __sync_fetch_and_or(&dev->has_posted, 1);
+
+  if (root->link.gen) pcie_net_wait_ns(&root->net, busy);
+
+  return pcie_net_send_iov(&root->net, iovs, niov);
+}
+
+int pcie_dma_write
+(
+ pcie_dev_t* dev,
+ uint64_t addr, const struct iovec* iov, size_t iovcnt,
+ unsigned int flags
+)
+{
+  dma_cursor_t c;
+
+  dma_init_cursor(&c, addr, iov, iovcnt);
+
+  while (dma_is_done(&c) == 0)
+  {
+    if (dma_send_batch(dev, &c)) return -1;
+  }
+
+  if (flags & PCIE_DMA_MSI) return pcie_send_msi(dev);
+
+  return 0;
+}
+
+/* asynchronous dma requests, one batch per loop iteration */
+
+typedef struct pcie_dma_req
+{
+  struct pcie_dma_req* next;
+  dma_cursor_t cursor;
+  unsigned int flags;
+  pcie_dma_donefn_t fn;
+  void* data;
+  /* copy of the caller iovecs */
+  struct iovec iov[1];
+} pcie_dma_req_t;
+
+static int dma_pop_req(pcie_dev_t* dev, int err)
+{
+  /* complete the head request, -1 if the queue is empty */
+
+  pcie_net_t* const net = &pcie_root(dev)->net;
+  pcie_dma_req_t* req;
+
+  /* the queue is shared with the lanes, the completion runs unlocked */
+  pcie_net_lock(net);
+  req = dev->dma_head;
+  if (req == NULL)
+  {
+    pcie_net_unlock(net);
+    return -1;
+  }
+  dev->dma_head = req->next;
+  if (dev->dma_head == NULL) dev->dma_tail = NULL;
+  pcie_net_unlock(net);
+
+  if (req->fn != NULL) req->fn(err, req->data);
+  if ((err == 0) && (req->flags & PCIE_DMA_MSI)) pcie_send_msi(dev);
+
+  pcie_net_free_buf(req);
+
+  return 0;
+}
+
+static void dma_task(void* opak)
+{
+  pcie_dev_t* const dev = (pcie_dev_t*)opak;
+  pcie_net_t* const net = &pcie_root(dev)->net;
+  pcie_dma_req_t* req;
+  int err;
+
+  /* only this task moves the head, requests are appended at the tail */
+  pcie_net_lock(net);
+  req = dev->dma_head;
+  /* completion functions may queue new requests */
+  if (req != NULL) dev->dma_in_task = 1;
+  pcie_net_unlock(net);
+
+  if (req == NULL) return ;
+
+  if (dma_send_batch(dev, &req->cursor))
+  {
+    PERROR();
+    dma_pop_req(dev, -1);
+  }
+  else if (dma_is_done(&req->cursor))
+  {
+    dma_pop_req(dev, 0);
+  }
+
+  pcie_net_lock(net);
+  dev->dma_in_task = 0;
+  /* let the loop process incoming messages, then continue */
+  err = (dev->dma_head != NULL) && pcie_add_task(dev, 0, dma_task, dev);
+  pcie_net_unlock(net);
+
+  if (err) dma_cancel_all(dev);
+}
+
+static void dma_cancel_all(pcie_dev_t* dev)
+{
+  while (dma_pop_req(dev, -1) == 0) ;
+}
+
+int pcie_dma_write_async
+(
+ pcie_dev_t* dev,
+ uint64_t addr, const struct iovec* iov, size_t iovcnt,
+ unsigned int flags,
+ pcie_dma_donefn_t fn, void* data
+)
+{
+  pcie_dma_req_t* req;
+  size_t size;
+
+  size = offsetof(pcie_dma_req_t, iov) + iovcnt * sizeof(struct iovec);
+  if (iovcnt == 0) size += sizeof(struct iovec);
+
+  req = pcie_net_alloc_buf(size);
+  if (req == NULL) return -1;
+
+  memcpy(req->iov, iov, iovcnt * sizeof(struct iovec));
+  dma_init_cursor(&req->cursor, addr, req->iov, iovcnt);
+  req->flags = flags;
+  req->fn = fn;
+  req->data = data;
+  req->next = NULL;
+
+  /* any thread, the task runs from the loop */
+  pcie_net_lock(&pcie_root(dev)->net);
+
+  if (dev->dma_tail == NULL)
+  {
+    if ((dev->dma_in_task == 0) && pcie_add_task(dev, 0, dma_task, dev))
+    {
+      pcie_net_unlock(&pcie_root(dev)->net);
+      pcie_net_free_buf(req);
+      return -1;
+    }
+    dev->dma_head = req;
+  }
+  else
+  {
+    dev->dma_tail->next = req;
+  }
+
+  dev->dma_tail = req;
+
+  pcie_net_unlock(&pcie_root(dev)->net);
+
+  return 0;
 }
@@ -5,16 +5,146 @@
 #include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <pci/header.h>
 #include "pcie_net.h"
 
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
 struct pcie_dev;
+struct pcie_dma_req;
+struct pcie_atomic_req;
 
 typedef void (*pcie_readfn_t)(uint64_t, void*, size_t, void*);
 
 typedef void (*pcie_writefn_t)(uint64_t, const void*, size_t, void*);
 
+/* doorbell address in bar, opaque */
+typedef void (*pcie_doorbellfn_t)(uint64_t, void*);
+
+/* register map, refer to pcie_set_bar_regmap */
+
+/* register access type */
+#define PCIE_REG_RO (1 << 0)
+#define PCIE_REG_RW (1 << 1)
+/* write one to clear */
+#define PCIE_REG_W1C (1 << 2)
+/* the write is stored, then on_write is called */
+#define PCIE_REG_ACTION (1 << 3)
+
+/* index, opaque. return the value to reply. */
+typedef uint32_t (*pcie_reg_readfn_t)(unsigned int, void*);
+
+/* index, stored value, opaque */
+typedef void (*pcie_reg_writefn_t)(unsigned int, uint32_t, void*);
+
+typedef struct pcie_reg
+{
+  /* offset in the bar, in bytes. must be 32 bits aligned. */
+  uint32_t addr;
+  uint32_t flags;
+  uint32_t reset;
+  /* optional hooks, NULL if unused */
+  pcie_reg_readfn_t on_read;
+  pcie_reg_writefn_t on_write;
+} pcie_reg_t;
+
+#define PCIE_REG(__addr, __flags, __reset) \
+{ (__addr), (__flags), (__reset), NULL, NULL }
+
+#define PCIE_REG_HOOK(__addr, __flags, __reset, __on_read, __on_write) \
+{ (__addr), (__flags), (__reset), (__on_read), (__on_write) }
+
+typedef struct pcie_regmap
+{
+  /* register values and descriptors, directly indexed by addr / 4. */
+  /* a NULL descriptor is unmapped: read all ones, write ignored. */
+  size_t count;
+  uint32_t* vals;
+  const pcie_reg_t** descs;
+  void* data;
+} pcie_regmap_t;
+
+/* device memory region, refer to pcie_init_mem */
+
+typedef struct pcie_mem
+{
+  uint8_t* base;
+  uint64_t size;
+  /* backing file, -1 if anonymous */
+  int fd;
+} pcie_mem_t;
+
+/* host memory shared with the device, refer to PCIE_NET_OP_MEM_MAP */
+
+typedef struct pcie_host_map
+{
+  uint64_t addr;
+  uint64_t size;
+  /* where addr is mapped */
+  uint8_t* base;
+  /* whole mapping, page aligned */
+  void* map;
+  size_t map_size;
+} pcie_host_map_t;
+
+/* doorbell register, refer to pcie_set_doorbell */
+
+typedef struct pcie_doorbell
+{
+  struct pcie_dev* dev;
+  unsigned int bar;
+  uint64_t addr;
+  pcie_doorbellfn_t fn;
+  void* data;
+  /* eventfd signaled by the host, -1 if writes are sent as messages */
+  int fd;
+} pcie_doorbell_t;
+
+/* link performance model, refer to pcie_set_link */
+
+typedef struct pcie_link
+{
+  /* 0 if the link model is disabled */
+  unsigned int gen;
+  unsigned int width;
+
+  /* max payload and read request sizes, in bytes. always valid, they
+     follow the PCIe capability device control register, as programmed
+     by the host.
+   */
+  unsigned int mps;
+  unsigned int mrrs;
+
+  /* one way latency, in nanoseconds */
+  unsigned int latency;
+
+  /* raw link rate, in bytes per nanosecond */
+  double rate;
+  /* per TLP framing, sequence, lcrc and header bytes */
+  unsigned int tlp_overhead;
+
+  /* transmitter busy until this date, in pcie_net_get_ns time */
+  uint64_t busy_ns;
+} pcie_link_t;
+
+/* TLP counters, as seen by the device. device initiated memory writes
+   count one TLP per mps bytes. non posted requests (config, memory
+   reads) count one rx TLP and one tx completion.
+ */
+
+typedef struct pcie_stats
+{
+  uint64_t tx_tlps;
+  uint64_t tx_bytes;
+  uint64_t rx_tlps;
+  uint64_t rx_bytes;
+} pcie_stats_t;
+
 typedef struct pcie_dev
 {
   pcie_net_t net;
@@ -24,9 +154,59 @@ typedef struct pcie_dev
   pcie_readfn_t bar_readfn[PCIE_BAR_COUNT];
   pcie_writefn_t bar_writefn[PCIE_BAR_COUNT];
   void* bar_data[PCIE_BAR_COUNT];
+  pcie_regmap_t* bar_regmap[PCIE_BAR_COUNT];
+  pcie_mem_t* bar_mem[PCIE_BAR_COUNT];
+  /* low bar register type bits. a 64 bits bar uses the next one too. */
+  uint32_t bar_type[PCIE_BAR_COUNT];
+
+  /* the link is owned by the physical function */
+  pcie_link_t link;
+  pcie_stats_t stats;
+
+  /* functions, refer to pcie_init_vf. a virtual function has no
+     connection of its own, it uses the one of its physical function.
+   */
+#define PCIE_FUNC_COUNT 32
+  struct pcie_dev* pf;
+  unsigned int fn;
+  struct pcie_dev* vfs[PCIE_FUNC_COUNT];
+
+  /* pending pcie_dma_write_async requests */
+  struct pcie_dma_req* dma_head;
+  struct pcie_dma_req* dma_tail;
+  unsigned int dma_in_task;
+
+  /* atomic operations waiting for their completion, in sending order.
+     owned by the physical function, the completions carry no function.
+   */
+  struct pcie_atomic_req* atomic_head;
+  struct pcie_atomic_req* atomic_tail;
 
   /* extended config space */
   uint8_t config[0x1000];
+  /* dwords not cached by the host, refer to pcie_set_config_volatile */
+  uint32_t config_volatile[PCIE_NET_CONFIG_DWORDS / 32];
+
+  /* bar range attributes, refer to pcie_set_bar_attr */
+#define PCIE_ATTR_COUNT 32
+  pcie_net_attr_t attrs[PCIE_ATTR_COUNT];
+  size_t attr_count;
+
+#define PCIE_DOORBELL_COUNT 8
+  pcie_doorbell_t doorbells[PCIE_DOORBELL_COUNT];
+  size_t doorbell_count;
+
+  /* msi eventfd, -1 if msi are sent as messages. refer to
+     PCIE_NET_OP_IRQFD_MAP and pcie_send_msi.
+   */
+  int msi_fd;
+  /* memory write messages sent since the last msi */
+  unsigned int has_posted;
+
+  /* host memory map, owned by the physical function */
+#define PCIE_HOST_MAP_COUNT PCIE_NET_FD_COUNT
+  pcie_host_map_t host_maps[PCIE_HOST_MAP_COUNT];
+  size_t host_map_count;
 
 } pcie_dev_t;
 
@@ -37,7 +217,24 @@ int pcie_init_net
 (pcie_dev_t*, const char*, const char*, const char*, const char*);
 int pcie_fini(pcie_dev_t*);
 
-/* main device loop */
+/* virtual function fn, in [1:31], hosted by the physical function
+   (vf, pf, fn). the vf has its own config space, bars, msi and dma
+   requests. it shares the pf event loop, connection and link. the
+   host addresses it by the function number in the message bar field.
+   pcie_fini on a vf detaches it from its pf.
+ */
+
+int pcie_init_vf(pcie_dev_t*, pcie_dev_t*, unsigned int);
+
+static inline pcie_dev_t* pcie_root(pcie_dev_t* dev)
+{
+  return (dev->pf == NULL) ? dev : dev->pf;
+}
+
+/* main device loop. when the host goes away, the pending dma are
+   cancelled and the loop waits for the next host. the device state is
+   kept, the host probes it again.
+ */
 
 int pcie_loop(pcie_dev_t*);
 
@@ -81,6 +278,13 @@ static inline int pcie_read_config
   return pcie_read_config_safe(dev, addr, data, size);
 }
 
+/* the host reads the config image once at connect time, then serves
+   config reads from its copy. registers the device changes by itself
+   after that must be marked volatile, so that the host reads them
+   from the device. status and link status are volatile by default.
+ */
+int pcie_set_config_volatile(pcie_dev_t*, uint64_t, size_t);
+
 /* TODO: use macro preprocessor */
 
 static inline int pcie_write_config_byte
@@ -134,20 +338,202 @@ static inline int pcie_set_deviceid(pcie_dev_t* dev, uint16_t id)
   return pcie_write_config_safe(dev, PCI_DEVICE_ID, &id, sizeof(id));
 }
 
-/* define bar and methods */
+/* define bar and methods, replacing a regmap or memory set before */
 
 int pcie_set_bar
 (pcie_dev_t*, unsigned long, size_t, pcie_readfn_t, pcie_writefn_t, void*);
 
-/* msi */
+/* declare the attributes of a bar range (dev, ibar, addr, size, attr),
+   attr in PCIE_NET_ATTR_XXX. they are sent to the host at probe time,
+   so that it can answer reads without asking the device: constant
+   identification registers, registers only the driver changes, write
+   only doorbells. up to PCIE_ATTR_COUNT ranges, before the host
+   probes the device.
+ */
+int pcie_set_bar_attr
+(pcie_dev_t*, unsigned long, uint64_t, uint64_t, unsigned int);
+
+/* doorbell register (dev, ibar, addr, fn, opaque). a host write at the
+   dword addr calls fn, the value is dropped. under KVM over a unix
+   socket, the host signals an eventfd instead, without running its
+   userland. bar handlers never see these writes. up to
+   PCIE_DOORBELL_COUNT per function, before the host probes the device.
+ */
+int pcie_set_doorbell
+(pcie_dev_t*, unsigned long, uint64_t, pcie_doorbellfn_t, void*);
+
+/* register map. vals is owned by the caller and holds count registers.
+   host accesses are 1, 2, 4 or 8 bytes wide. an access covering several
+   registers (a 64 bits register is a pair) stores them all, then calls
+   their on_write hooks in address order.
+ */
+
+int pcie_init_regmap
+(pcie_regmap_t*, uint32_t*, size_t, const pcie_reg_t*, size_t, void*);
+void pcie_fini_regmap(pcie_regmap_t*);
+void pcie_reset_regmap(pcie_regmap_t*);
+int pcie_set_bar_regmap(pcie_dev_t*, unsigned long, size_t, pcie_regmap_t*);
+
+/* device memory regions, for large on board memories. the region is
+   a sparse mapping: host memory is only used for the pages touched.
+   size in bytes. path is a file to map, created if needed, or NULL for
+   anonymous memory. flags is a mask of PCIE_MEM_XXX.
+ */
+
+/* advise the kernel to use transparent huge pages */
+#define PCIE_MEM_HUGEPAGE (1 << 0)
+
+int pcie_init_mem(pcie_mem_t*, uint64_t, const char*, unsigned int);
+void pcie_fini_mem(pcie_mem_t*);
+
+static inline void* pcie_mem_at(const pcie_mem_t* mem, uint64_t off)
+{
+  return (void*)(mem->base + off);
+}
+
+/* the region is served by the runtime through a 64 bits prefetchable
+   bar, using ibar and ibar + 1. the region size must be a power of 2.
+ */
+int pcie_set_bar_mem(pcie_dev_t*, unsigned long, pcie_mem_t*);
+
+/* dma size bytes at offset off in the region to host memory (dev, host
+   address, region, off, size, flags). data are sent from the mapping.
+ */
+int pcie_dma_write_mem
+(pcie_dev_t*, uint64_t, const pcie_mem_t*, uint64_t, size_t, unsigned int);
+
+/* msi. when the host passes an irqfd, the msi is a single eventfd
+   write, unless memory write messages were sent since the previous
+   msi: the message then keeps the order with them. dma writes to
+   shared host memory do not count, refer to pcie_host_mem.
+ */
 
 int pcie_send_msi(pcie_dev_t*);
 
-/* add a task to perform in usec */
+/* send a message initiated by the device (WRITE_MEM ...). when the link
+   model is enabled, the call returns once the message would be on the
+   wire. devices should use it instead of pcie_net_send_msg.
+ */
+
+int pcie_send_msg(pcie_dev_t*, pcie_net_msg_t*);
+
+/* write to host memory (address, data, size). the transfer is split in
+   max payload size TLPs, as negotiated in the PCIe capability.
+ */
+
+int pcie_write_mem(pcie_dev_t*, uint64_t, const void*, size_t);
+
+/* scatter gather dma write to host memory. the iovecs are sent to the
+   contiguous host address as mps sized TLPs, directly from the device
+   buffers and batched in few system calls.
+ */
+
+/* send a MSI once the data are written */
+#define PCIE_DMA_MSI (1 << 0)
+
+/* status (0 or -1), opaque */
+typedef void (*pcie_dma_donefn_t)(int, void*);
+
+/* dev, host address, iov, iovcnt, flags. returns once sent. */
+int pcie_dma_write
+(pcie_dev_t*, uint64_t, const struct iovec*, size_t, unsigned int);
+
+/* same, the transfer progresses from the device loop in between other
+   messages. the iovec array is copied but the buffers must be kept
+   until the completion function is called. requests complete in order.
+   with PCIE_DMA_MSI, the MSI is sent after the completion function.
+ */
+int pcie_dma_write_async
+(
+ pcie_dev_t*, uint64_t, const struct iovec*, size_t, unsigned int,
+ pcie_dma_donefn_t, void*
+);
+
+/* shared host memory, refer to PCIE_NET_OP_MEM_MAP. dma writes falling
+   in it are copied directly, and only a MEM_SYNC marker is sent.
+   pcie_host_mem returns where host memory is mapped (dev, host address,
+   size), or NULL if it is not shared. written data must be followed by
+   pcie_sync_host_mem on the same range.
+ */
+
+void* pcie_host_mem(pcie_dev_t*, uint64_t, size_t);
+int pcie_sync_host_mem(pcie_dev_t*, uint64_t, size_t);
+
+/* atomic operations on host memory (AtomicOp TLPs): dev, host address,
+   width (4 or 8 bytes, naturally aligned), operands. the request is
+   sent at once, and fn is called with the status (0 on success) and
+   the original value when the loop receives the host completion. the
+   pending requests fail if the host disconnects. any thread, return 0
+   if sent.
+ */
+
+typedef void (*pcie_atomic_donefn_t)(int, uint64_t, void*);
+
+int pcie_atomic_fetch_add_async
+(pcie_dev_t*, uint64_t, unsigned int, uint64_t, pcie_atomic_donefn_t, void*);
+int pcie_atomic_swap_async
+(pcie_dev_t*, uint64_t, unsigned int, uint64_t, pcie_atomic_donefn_t, void*);
+int pcie_atomic_cas_async
+(
+ pcie_dev_t*, uint64_t, unsigned int, uint64_t, uint64_t,
+ pcie_atomic_donefn_t, void*
+);
+
+/* blocking conveniences, giving the original value. they wait for the
+   loop to deliver the completion, and fail from the loop thread (ie.
+   from a task or a main connection handler). use them from a lane or
+   another thread. return 0 on success.
+ */
+
+int pcie_atomic_fetch_add
+(pcie_dev_t*, uint64_t, unsigned int, uint64_t, uint64_t*);
+int pcie_atomic_swap
+(pcie_dev_t*, uint64_t, unsigned int, uint64_t, uint64_t*);
+int pcie_atomic_cas
+(pcie_dev_t*, uint64_t, unsigned int, uint64_t, uint64_t, uint64_t*);
+
+/* link model: gen in [1:3], width in lanes (1, 2, 4, 8, 12 or 16),
+   mps and mrrs in bytes. the device messages and read completions are
+   paced to the bandwidth and latency of such a link. the PCIe
+   capability link status, and mps and mrrs initial values are updated
+   accordingly. the host can then change mps and mrrs in the device
+   control register. gen 0 disables the model (default). it can also be
+   enabled by PCIE_LINK_GEN, PCIE_LINK_WIDTH, PCIE_LINK_MPS,
+   PCIE_LINK_MRRS and PCIE_LINK_LATENCY (ns) environment variables.
+ */
+
+int pcie_set_link
+(pcie_dev_t*, unsigned int, unsigned int, unsigned int, unsigned int);
+
+/* add a task to perform in usec. any number of tasks can be pending. */
 int pcie_add_task(pcie_dev_t*, unsigned long, pcie_net_taskfn_t, void*);
 
+/* task clock, PCIE_NET_TIME_REAL or PCIE_NET_TIME_VIRTUAL. task delays
+   are multiplied by scale. in virtual mode, time jumps to the next task
+   deadline as soon as there is nothing else to do.
+ */
+static inline int pcie_set_time(pcie_dev_t* dev, unsigned int mode, double scale)
+{ return pcie_net_set_time(&pcie_root(dev)->net, mode, scale); }
+
+/* serve up to n host cpus concurrently, each one on its own lane and
+   thread. bar handlers, regmap hooks and bar memory are then accessed
+   from those threads, and the device protects its own state. from a
+   handler, tasks can be added, and msis, messages, dma writes and
+   atomic operations sent: the runtime serializes them, as well as the
+   counters and the link model. atomic completions are delivered by the
+   loop thread. a host cpu memory writes are ordered with its config
+   accesses, the host fencing its lane before them.
+ */
+static inline int pcie_set_lanes(pcie_dev_t* dev, size_t n)
+{ return pcie_net_set_lanes(&pcie_root(dev)->net, n); }
+
 /* add an event */
 int pcie_add_event(pcie_dev_t*, int, pcie_net_evfn_t, void*);
 
 
+#ifdef __cplusplus
+}
+#endif
+
+
 #endif /* ! PCIE_H_INCLUDED */
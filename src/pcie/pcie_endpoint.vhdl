@@ -17,6 +17,7 @@ entity endpoint is
   req_bar: out std_ulogic_vector(pcie.BAR_WIDTH - 1 downto 0);
   req_addr: out std_ulogic_vector(pcie.ADDR_WIDTH - 1 downto 0);
   req_data: out std_ulogic_vector(pcie.DATA_WIDTH - 1 downto 0);
+  req_size: out std_ulogic_vector(pcie.SIZE_WIDTH - 1 downto 0);
 
   rep_en: in std_ulogic;
   rep_data: in std_ulogic_vector(pcie.DATA_WIDTH - 1 downto 0);
@@ -59,6 +60,7 @@ begin
    req_wr <= '0';
    req_bar <= (others => '0');
    req_addr <= (others => '0');
+   req_size <= (others => '0');
 
    -- msi
    if msi_en = '1' then
@@ -102,6 +104,7 @@ begin
      req_en <= '1';
      req_bar <= std_ulogic_vector(var_req_bar(2 downto 0));
      req_addr <= std_ulogic_vector(var_req_addr);
+     req_size <= std_ulogic_vector(var_req_size);
      write(l, String'("size "));
      write(l, integer'image(to_integer(var_req_size)));
      writeline(output, l);
@@ -113,6 +116,7 @@ begin
     req_en <= '1';
     req_bar <= std_ulogic_vector(var_req_bar(2 downto 0));
     req_addr <= std_ulogic_vector(var_req_addr);
+    req_size <= std_ulogic_vector(var_req_size);
     -- write access
     if var_req_is_read = "00" then
      req_data <= std_ulogic_vector(var_req_data);
@@ -68,6 +68,19 @@ static int fifo_init(fifo_t* f)
   return 0;
 }
 
+static inline fnode_t* fifo_alloc_node(size_t size)
+{
+  /* pooled, nodes are allocated and freed at simulation rate */
+  fnode_t* const node = pcie_net_alloc_buf(size);
+  node->next = NULL;
+  return node;
+}
+
+static inline void fifo_free_node(fnode_t* node)
+{
+  pcie_net_free_buf(node);
+}
+
 static void fifo_fini(fifo_t* f)
 {
   fnode_t* i = f->head;
@@ -76,19 +89,12 @@ static void fifo_fini(fifo_t* f)
   {
     fnode_t* const tmp = i;
     i = i->next;
-    free(tmp);
+    fifo_free_node(tmp);
   }
 
   pthread_mutex_destroy(&f->lock);
 }
 
-static inline fnode_t* fifo_alloc_node(size_t size)
-{
-  fnode_t* const node = malloc(size);
-  node->next = NULL;
-  return node;
-}
-
 static fnode_t* fifo_alloc_access_node
 (
  unsigned int is_read,
@@ -141,6 +147,10 @@ typedef struct thread_context
 
   volatile unsigned int state;
 
+  /* io thread, started late in fork server mode */
+  pthread_t thread;
+  unsigned int has_thread;
+
 } thread_context_t;
 
 
@@ -165,18 +175,34 @@ static void on_bar_read
   if (size > node->u.bar_access.size) size = node->u.bar_access.size;
   memcpy(data, node->u.bar_access.data, size);
 
-  free(node);
+  fifo_free_node(node);
 }
 
 static void on_bar_write
 (unsigned int bar, uint64_t addr, const void* data, size_t size, void* opak)
 {
   thread_context_t* const c = opak;
-  fnode_t* const node = fifo_alloc_access_node(0, bar, addr, size, data);
+  const uint8_t* p = data;
+  size_t n = size;
 
   PRINTF("%s\n", __FUNCTION__);
 
-  fifo_push_node(&c->rx_fifo, node);
+  /* the design takes native accesses up to 8 bytes (req_size). only
+     the PCIE_NET_ATTR_WC ranges receive combined writes, and the glue
+     marks none: a write up to 8 bytes is then a single host access.
+     a larger one can only be a burst, split in dwords for the design.
+   */
+  if (size > sizeof(((fnode_t*)NULL)->u.bar_access.data))
+    n = sizeof(uint32_t);
+
+  while (size)
+  {
+    if (n > size) n = size;
+    fifo_push_node(&c->rx_fifo, fifo_alloc_access_node(0, bar, addr, n, p));
+    size -= n;
+    addr += n;
+    p += n;
+  }
 }
 
 #define DEFINE_BAR_HANDLERS(__n)				\
@@ -225,8 +251,8 @@ static int on_event(unsigned int key, void* opak)
   {
     fnode_t* const pos = head;
     head = head->next;
-    pcie_net_send_msg(&dev->net, &pos->u.msg);
-    free(pos);
+    pcie_send_msg(dev, &pos->u.msg);
+    fifo_free_node(pos);
   }
 
   return 0;
@@ -237,9 +263,8 @@ static int on_event(unsigned int key, void* opak)
 
 static thread_context_t g_thread_context;
 
-static void* thread_entry(void* fu)
+static int glue_init(thread_context_t* c)
 {
-  thread_context_t* const c = &g_thread_context;
   pcie_dev_t* const dev = &c->dev;
   unsigned int bar_size[PCIE_BAR_COUNT] = { 0, };
   pcie_readfn_t bar_readfn[PCIE_BAR_COUNT];
@@ -313,38 +338,71 @@ static void* thread_entry(void* fu)
   bar_writefn[5] = on_bar5_write;
 #endif
 
-  pipe(c->ev_fds);
+  if (pipe(c->ev_fds)) { PERROR(); return -1; }
 
   fifo_init(&c->tx_fifo);
   fifo_init(&c->rx_fifo);
   c->reply_node = NULL;
 
-  /* state is inited already done by spawner */
-  /* c->state = 0; */
+  if (pcie_init_net(dev, laddr, lport, raddr, rport))
+  {
+    PERROR();
+    fifo_fini(&c->tx_fifo);
+    fifo_fini(&c->rx_fifo);
+    close(c->ev_fds[0]);
+    close(c->ev_fds[1]);
+    return -1;
+  }
 
-  pcie_init_net(dev, laddr, lport, raddr, rport);
   pcie_add_event(dev, c->ev_fds[0], on_event, c);
   pcie_set_vendorid(dev, vendor_id);
   pcie_set_deviceid(dev, device_id);
   for (i = 0; i < PCIE_BAR_COUNT; ++i)
     pcie_set_bar(dev, i, bar_size[i], bar_readfn[i], bar_writefn[i], c);
 
-  /* commit the status */
-  c->state = 1;
-
-  while (c->state != 0) pcie_loop(dev);
+  return 0;
+}
 
-  pcie_fini(dev);
+static void glue_fini(thread_context_t* c)
+{
+  pcie_fini(&c->dev);
 
   fifo_fini(&c->tx_fifo);
   fifo_fini(&c->rx_fifo);
 
   close(c->ev_fds[0]);
   close(c->ev_fds[1]);
+}
+
+static void* thread_entry(void* fu)
+{
+  thread_context_t* const c = &g_thread_context;
+  pcie_dev_t* const dev = &c->dev;
+
+  while (c->state != 0)
+  {
+    pcie_loop(dev);
+
+    /* forked session, the process ends with the connection */
+    if (dev->net.fork_server && (c->state != 0)) exit(0);
+  }
 
   return NULL;
 }
 
+static int start_thread(thread_context_t* c)
+{
+  if (pthread_create(&c->thread, NULL, thread_entry, NULL))
+  {
+    PERROR();
+    return -1;
+  }
+
+  c->has_thread = 1;
+
+  return 0;
+}
+
 
 /* ghdl argument conversion routines, refer to ghpi.h */
 
@@ -531,6 +589,15 @@ void pcie_glue_poll_rx_fifo
   thread_context_t* const c = &g_thread_context;
   fnode_t* node;
 
+  /* fork server mode. the first poll happens once the design is out of
+     reset, fork sessions from there. the io thread must be started
+     after fork, as only the calling thread exists in the child.
+   */
+  if (c->has_thread == 0)
+  {
+    if (pcie_net_accept(&c->dev.net) || start_thread(c)) exit(-1);
+  }
+
   /* pop head first */
   pthread_mutex_lock(&c->rx_fifo.lock);
   if ((node = c->rx_fifo.head))
@@ -560,7 +627,7 @@ void pcie_glue_poll_rx_fifo
       memcpy(&x, node->u.bar_access.data, node->u.bar_access.size);
       PRINTF(". data: 0x%lx\n", x);
       uint64_to_logic(x, data);
-      free(node);
+      fifo_free_node(node);
     }
     else
     {
@@ -568,7 +635,7 @@ void pcie_glue_poll_rx_fifo
       if (c->reply_node != NULL)
       {
 	PRINTF("arg->reply_node != NULL\n");
-	free(node);
+	fifo_free_node(node);
 	goto empty_case;
       }
       /* should_not_occur */
@@ -591,25 +658,27 @@ void pcie_glue_poll_rx_fifo
 
 int pcie_glue_create_thread(pthread_t* thread_handle)
 {
-  void* thread_res;
+  thread_context_t* const c = &g_thread_context;
 
-  /* init before spawning */
-  g_thread_context.state = 0;
+  /* the device is initialized by the calling thread. without fork
+     server, it returns once connected and the io thread is running.
+   */
 
-  if (pthread_create(thread_handle, NULL, thread_entry, NULL))
-  {
-    PERROR();
-    return -1;
-  }
+  c->has_thread = 0;
+
+  if (glue_init(c)) return -1;
 
-  while (g_thread_context.state == 0) ;
+  c->state = 1;
 
-  /* thread start failed, do not wait */
-  if (g_thread_context.state != 1)
+  if (c->dev.net.fork_server == 0)
   {
-    PERROR();
-    pthread_join(*thread_handle, &thread_res);
-    return -1;
+    if (start_thread(c))
+    {
+      glue_fini(c);
+      return -1;
+    }
+
+    *thread_handle = c->thread;
   }
 
   return 0;
@@ -617,11 +686,19 @@ int pcie_glue_create_thread(pthread_t* thread_handle)
 
 void pcie_glue_join_thread(pthread_t thread_handle)
 {
+  thread_context_t* const c = &g_thread_context;
   void* thread_res;
 
-  g_thread_context.state = 0;
+  /* thread_handle kept for compatibility, started late with fork server */
+
+  c->state = 0;
   __sync_synchronize();
-  write(g_thread_context.ev_fds[1], &evk_quit, sizeof(evk_quit));
 
-  pthread_join(thread_handle, &thread_res);
+  if (c->has_thread)
+  {
+    write(c->ev_fds[1], &evk_quit, sizeof(evk_quit));
+    pthread_join(c->thread, &thread_res);
+  }
+
+  glue_fini(c);
 }
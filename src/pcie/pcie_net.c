@@ -9,13 +9,23 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/select.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sched.h>
 
 #define CONFIG_USE_UDP 0
 #include "pcie_net.h"
 
 
+#ifndef CONFIG_DEBUG
 #define CONFIG_DEBUG 1
+#endif
 #if CONFIG_DEBUG
 #include <stdio.h>
 #define PRINTF(__s, ...)  \
@@ -85,13 +95,57 @@ static int open_udp_socket
 
 
 #if (CONFIG_USE_UDP == 0)
-static int open_tcp_socket
+static int accept_stream_socket(int server_fd)
+{
+  static const int on = 1;
+  const int fd = accept(server_fd, NULL, NULL);
+
+  /* small messages (replies, msi) must not wait for acks. fails on
+     unix sockets, which do not need it.
+   */
+  if (fd != -1)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&on, sizeof(on));
+
+  return fd;
+}
+
+static int listen_unix_socket(const char* path)
+{
+  struct sockaddr_un sun;
+  int fd;
+
+  if (strlen(path) >= sizeof(sun.sun_path)) { PERROR(); return -1; }
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) { PERROR(); return -1; }
+
+  /* left by a previous run */
+  unlink(path);
+
+  if (bind(fd, (const struct sockaddr*)&sun, sizeof(sun)) ||
+      listen(fd, 1 + PCIE_NET_LANE_COUNT))
+  {
+    PERROR();
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int open_stream_socket
 (
  const char* laddr, const char* lport,
  const char* raddr, const char* rport,
- int* server_fd, int* client_fd
+ int* server_fd, int* client_fd, unsigned int do_accept
 )
 {
+  /* tcp, or unix if laddr is PCIE_NET_UNIX_PREFIX followed by a path */
+
   static const int on = 1;
 
   int err = -1;
@@ -101,6 +155,13 @@ static int open_tcp_socket
   *server_fd = -1;
   *client_fd = -1;
 
+  if (strncmp(laddr, PCIE_NET_UNIX_PREFIX, strlen(PCIE_NET_UNIX_PREFIX)) == 0)
+  {
+    *server_fd = listen_unix_socket(laddr + strlen(PCIE_NET_UNIX_PREFIX));
+    if (*server_fd == -1) goto on_error;
+    goto on_listen;
+  }
+
   /* local addressing info */
   memset(&ai, 0, sizeof(ai));
   ai.ai_flags = AI_CANONNAME | AI_ADDRCONFIG;
@@ -114,10 +175,15 @@ static int open_tcp_socket
 
   if (bind(*server_fd, lai->ai_addr, lai->ai_addrlen) < 0)
     { PERROR(); goto on_error; }
-  if (listen(*server_fd, 1)) { PERROR(); goto on_error; }
+  if (listen(*server_fd, 1 + PCIE_NET_LANE_COUNT)) { PERROR(); goto on_error; }
 
-  *client_fd = accept(*server_fd, NULL, NULL);
-  if (*client_fd < 0) { PERROR(); goto on_error; }
+ on_listen:
+  /* fork server, accepted later by pcie_net_accept */
+  if (do_accept)
+  {
+    *client_fd = accept_stream_socket(*server_fd);
+    if (*client_fd < 0) { PERROR(); goto on_error; }
+  }
 
   /* success */
   err = 0;
@@ -140,9 +206,377 @@ static int open_tcp_socket
 
   return -1;
 }
+
+static void close_rx_fds(pcie_net_t* net)
+{
+  size_t i;
+  for (i = 0; i < net->rx_fd_count; ++i) close(net->rx_fds[i]);
+  net->rx_fd_count = 0;
+}
+
+static ssize_t recv_with_fds(pcie_net_t* net, void* buf, size_t size)
+{
+  /* fds passed over unix sockets are attached to the first message
+     byte. they are kept for pcie_net_take_fds until the next message.
+   */
+
+  union
+  {
+    struct cmsghdr h;
+    uint8_t buf[CMSG_SPACE(PCIE_NET_FD_COUNT * sizeof(int))];
+  } u;
+
+  struct msghdr mh;
+  struct iovec iov;
+  struct cmsghdr* cm;
+  ssize_t n;
+
+  close_rx_fds(net);
+
+  iov.iov_base = buf;
+  iov.iov_len = size;
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = u.buf;
+  mh.msg_controllen = sizeof(u.buf);
+
+  n = recvmsg(net->fd, &mh, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  if (n <= 0) return n;
+
+  for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm))
+  {
+    const int* fds = (const int*)CMSG_DATA(cm);
+    size_t i;
+
+    if ((cm->cmsg_level != SOL_SOCKET) || (cm->cmsg_type != SCM_RIGHTS))
+      continue ;
+
+    for (i = 0; i < (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int); ++i)
+    {
+      if (net->rx_fd_count == PCIE_NET_FD_COUNT) close(fds[i]);
+      else net->rx_fds[net->rx_fd_count++] = fds[i];
+    }
+  }
+
+  return n;
+}
+
+
+/* lanes, refer to PCIE_NET_OP_LANE. one thread per lane, blocking on
+   its socket. replies carry tx_seq as read once the handler returned.
+ */
+
+static ssize_t recv_lane_msg(int fd, pcie_net_msg_t* m)
+{
+  ssize_t n;
+  size_t rem_size;
+
+  n = recv(fd, (void*)&m->header, sizeof(m->header), MSG_WAITALL);
+  if (n != sizeof(m->header)) return -1;
+
+  if ((m->header.size < offsetof(pcie_net_msg_t, data)) ||
+      (m->header.size > PCIE_NET_MSG_MAX_SIZE))
+    { PERROR(); return -1; }
+
+  rem_size = m->header.size - sizeof(m->header);
+  n = recv(fd, (uint8_t*)m + sizeof(m->header), rem_size, MSG_WAITALL);
+  if (n != (ssize_t)rem_size) return -1;
+  return (ssize_t)m->header.size;
+}
+
+static void* lane_thread(void* p)
+{
+  pcie_net_lane_t* const lane = (pcie_net_lane_t*)p;
+  pcie_net_t* const net = lane->net;
+  pcie_net_lane_reply_t reply;
+  pcie_net_msg_t* msg;
+  unsigned int must_reply;
+  unsigned int is_open = 0;
+
+  msg = pcie_net_alloc_buf(PCIE_NET_MSG_MAX_SIZE);
+  if (msg == NULL) goto on_done;
+
+  while (recv_lane_msg(lane->fd, msg) > 0)
+  {
+    reply.status = 0;
+    memset(reply.data, 0, sizeof(reply.data));
+
+    if (msg->op == PCIE_NET_OP_LANE)
+    {
+      /* the next ones are fences, the previous messages are done */
+      if (is_open == 0) PRINTF("lane %u\n", (unsigned int)msg->addr);
+      is_open = 1;
+      must_reply = 1;
+    }
+    else if (msg->op <= PCIE_NET_OP_WRITE_IO)
+    {
+      /* same layout, up to seq */
+      must_reply =
+	net->recv_fn(msg, (pcie_net_reply_t*)&reply, net->recv_data);
+    }
+    else
+    {
+      PRINTF("[!] lane op %u\n", msg->op);
+      continue ;
+    }
+
+    if (must_reply == 0) continue ;
+
+    reply.header.size = sizeof(reply);
+    reply.seq = __sync_fetch_and_add(&net->tx_seq, 0);
+    if (send(lane->fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply))
+      break ;
+  }
+
+  pcie_net_free_buf(msg);
+
+ on_done:
+  lane->is_done = 1;
+  return NULL;
+}
+
+static void close_lanes(pcie_net_t* net, unsigned int only_done)
+{
+  /* join the lane threads, all of them or the closed ones. the freed
+     slots have fd set to -1. slots do not move, the threads use them.
+   */
+
+  size_t i;
+
+  for (i = 0; i != net->lane_count; ++i)
+  {
+    pcie_net_lane_t* const lane = &net->lanes[i];
+
+    if (lane->fd == -1) continue ;
+    if (only_done && (lane->is_done == 0)) continue ;
+
+    shutdown(lane->fd, SHUT_RDWR);
+    pthread_join(lane->thread, NULL);
+    close(lane->fd);
+    lane->fd = -1;
+  }
+}
+
+static void accept_lane(pcie_net_t* net)
+{
+  pcie_net_lane_t* lane = NULL;
+  size_t n = 0;
+  size_t i;
+  int fd;
+
+  fd = accept_stream_socket(net->server_fd);
+  if (fd == -1) { PERROR(); return ; }
+
+  close_lanes(net, 1);
+
+  for (i = 0; i != net->lane_count; ++i)
+  {
+    if (net->lanes[i].fd != -1) ++n;
+    else if (lane == NULL) lane = &net->lanes[i];
+  }
+
+  if ((lane == NULL) && (net->lane_count != PCIE_NET_LANE_COUNT))
+    lane = &net->lanes[net->lane_count];
+
+  /* refused, the host goes on without this lane */
+  if ((n == net->lane_max) || (lane == NULL))
+  {
+    PRINTF("[!] lane refused\n");
+    close(fd);
+    return ;
+  }
+
+  lane->net = net;
+  lane->fd = fd;
+  lane->is_done = 0;
+  if (pthread_create(&lane->thread, NULL, lane_thread, lane))
+  {
+    PERROR();
+    close(fd);
+    lane->fd = -1;
+    return ;
+  }
+
+  if (lane == &net->lanes[net->lane_count]) ++net->lane_count;
+}
+
+static void accept_peer(pcie_net_t* net)
+{
+  net->fd = accept_stream_socket(net->server_fd);
+  if (net->fd == -1) { PERROR(); return ; }
+
+  /* lane replies count from the connection start */
+  net->tx_seq = 0;
+
+  PRINTF("peer connected\n");
+}
+
 #endif /* (CONFIG_USE_UDP == 0) */
 
 
+/* clock */
+
+static inline uint64_t tv_to_ns(const struct timeval* tv)
+{
+  return (uint64_t)tv->tv_sec * 1000000000 + (uint64_t)tv->tv_usec * 1000;
+}
+
+static inline uint64_t get_real_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t get_vtime(pcie_net_t* net)
+{
+  /* advanced by any thread, refer to pcie_net_wait_ns */
+  return __sync_fetch_and_add(&net->vtime, 0);
+}
+
+static inline void get_now(pcie_net_t* net, struct timeval* now)
+{
+  if (net->time_mode == PCIE_NET_TIME_VIRTUAL)
+  {
+    const uint64_t vtime = get_vtime(net);
+    now->tv_sec = vtime / 1000000000;
+    now->tv_usec = (vtime % 1000000000) / 1000;
+  }
+  else
+  {
+    gettimeofday(now, NULL);
+  }
+}
+
+static void scale_time
+(pcie_net_t* net, const struct timeval* tm, struct timeval* res)
+{
+  uint64_t usecs = (uint64_t)tm->tv_sec * 1000000 + (uint64_t)tm->tv_usec;
+
+  if (net->time_scale != 1.0)
+    usecs = (uint64_t)((double)usecs * net->time_scale);
+
+  res->tv_sec = usecs / 1000000;
+  res->tv_usec = usecs % 1000000;
+}
+
+
+/* task heap, earliest deadline at index 0. tasks may be added by the
+   lane threads, the heap is accessed with the runtime lock held.
+ */
+
+static void task_heap_up(pcie_net_t* net, size_t i)
+{
+  pcie_net_task_t* const t = net->tasks;
+
+  while (i)
+  {
+    const size_t j = (i - 1) / 2;
+    pcie_net_task_t tmp;
+    if (!timercmp(&t[i].tm, &t[j].tm, <)) break ;
+    tmp = t[i]; t[i] = t[j]; t[j] = tmp;
+    i = j;
+  }
+}
+
+static void task_heap_down(pcie_net_t* net, size_t i)
+{
+  pcie_net_task_t* const t = net->tasks;
+  const size_t n = net->task_count;
+
+  while (1)
+  {
+    const size_t l = 2 * i + 1;
+    const size_t r = l + 1;
+    size_t k = i;
+    pcie_net_task_t tmp;
+
+    if ((l < n) && timercmp(&t[l].tm, &t[k].tm, <)) k = l;
+    if ((r < n) && timercmp(&t[r].tm, &t[k].tm, <)) k = r;
+    if (k == i) break ;
+
+    tmp = t[i]; t[i] = t[k]; t[k] = tmp;
+    i = k;
+  }
+}
+
+static void task_heap_pop(pcie_net_t* net, pcie_net_task_t* task)
+{
+  *task = net->tasks[0];
+  net->tasks[0] = net->tasks[--net->task_count];
+  task_heap_down(net, 0);
+}
+
+static void run_due_tasks(pcie_net_t* net)
+{
+  struct timeval now;
+  pcie_net_task_t task;
+
+  get_now(net, &now);
+
+  while (1)
+  {
+    pcie_net_lock(net);
+
+    if ((net->task_count == 0) || timercmp(&net->tasks[0].tm, &now, >))
+    {
+      pcie_net_unlock(net);
+      break ;
+    }
+
+    /* pop before executing, in case of reloading */
+    task_heap_pop(net, &task);
+
+    pcie_net_unlock(net);
+
+    task.fn(task.data);
+  }
+}
+
+static struct timeval* get_task_timeout(pcie_net_t* net, struct timeval* tm)
+{
+  /* time until the next deadline, NULL if no task */
+
+  struct timeval now;
+  struct timeval next;
+  size_t n;
+
+  pcie_net_lock(net);
+  n = net->task_count;
+  if (n) next = net->tasks[0].tm;
+  pcie_net_unlock(net);
+
+  if (n == 0) return NULL;
+
+  /* virtual time: poll, time only advances when idle */
+  if (net->time_mode == PCIE_NET_TIME_VIRTUAL)
+  {
+    timerclear(tm);
+    return tm;
+  }
+
+  gettimeofday(&now, NULL);
+
+  if (timercmp(&next, &now, <)) timerclear(tm);
+  else timersub(&next, &now, tm);
+
+  return tm;
+}
+
+static uint64_t get_next_deadline(pcie_net_t* net)
+{
+  uint64_t ns = 0;
+
+  pcie_net_lock(net);
+  if (net->task_count) ns = tv_to_ns(&net->tasks[0].tm);
+  pcie_net_unlock(net);
+
+  return ns;
+}
+
+
 /* exported */
 
 int pcie_net_init
@@ -152,30 +586,138 @@ int pcie_net_init
  const char* raddr, const char* rport
 )
 {
+  const char* s;
+  pthread_mutexattr_t attr;
+
+  /* tasks and messages may nest, from the loop or lane threads */
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&net->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
   /* important, use by event pump */
-  net->task_fn = NULL;
+  net->tasks = NULL;
+  net->is_looping = 0;
+  net->task_count = 0;
+  net->task_max = 0;
+
+  /* real time, unless overriden by the environment */
+  net->time_mode = PCIE_NET_TIME_REAL;
+  net->time_scale = 1.0;
+  if ((s = getenv("PCIE_NET_TIME_SCALE")) != NULL)
+    net->time_scale = strtod(s, NULL);
+  if (((s = getenv("PCIE_NET_TIME")) != NULL) && (strcmp(s, "virtual") == 0))
+    pcie_net_set_time(net, PCIE_NET_TIME_VIRTUAL, net->time_scale);
 
   net->ev_fd = -1;
+  net->watch_count = 0;
+  net->rx_fd_count = 0;
+
+  net->tx_seq = 0;
+  net->lane_count = 0;
+  net->lane_max = 0;
+  net->recv_fn = NULL;
+  net->recv_data = NULL;
+
+  net->close_fn = NULL;
+  net->close_data = NULL;
+
+  net->fork_server = 0;
+  if ((s = getenv("PCIE_NET_FORK")) != NULL)
+    net->fork_server = (unsigned int)strtoul(s, NULL, 10);
 
 #if (CONFIG_USE_UDP == 1)
+  net->fork_server = 0;
   net->fd = open_udp_socket(laddr, lport, raddr, rport);
   if (net->fd == -1) return -1;
 #else
-  if (open_tcp_socket(laddr, lport, raddr, rport, &net->server_fd, &net->fd))
+  if (open_stream_socket
+      (laddr, lport, raddr, rport, &net->server_fd, &net->fd,
+       net->fork_server == 0))
     return -1;
 #endif
 
   return 0;
 }
 
+int pcie_net_accept(pcie_net_t* net)
+{
+#if (CONFIG_USE_UDP == 0)
+  pid_t pid;
+  int status;
+
+  /* connected already */
+  if (net->fd != -1) return 0;
+
+  /* the parent never returns from this loop. it stays at the point the
+     device reached once initialized, and forks a child per session.
+     sessions are served one at a time, as the children all start from
+     the same state and would otherwise share files and devices.
+   */
+
+  while (1)
+  {
+    net->fd = accept_stream_socket(net->server_fd);
+    if (net->fd == -1)
+    {
+      if (errno == EINTR) continue ;
+      PERROR();
+      return -1;
+    }
+
+    /* do not duplicate buffered output */
+    fflush(stdout);
+
+    pid = fork();
+    if (pid == -1)
+    {
+      PERROR();
+      close(net->fd);
+      net->fd = -1;
+      return -1;
+    }
+
+    if (pid == 0)
+    {
+      /* child, the session starts here. it accepts its own lanes. */
+      if (net->lane_max == 0)
+      {
+	close(net->server_fd);
+	net->server_fd = -1;
+      }
+      return 0;
+    }
+
+    PRINTF("fork server: session %d\n", (int)pid);
+
+    close(net->fd);
+    net->fd = -1;
+
+    while (waitpid(pid, &status, 0) == -1)
+    {
+      if (errno != EINTR) { PERROR(); break ; }
+    }
+  }
+#endif /* CONFIG_USE_UDP */
+
+  return 0;
+}
+
 int pcie_net_fini(pcie_net_t* net)
 {
 #if (CONFIG_USE_UDP == 0)
-  shutdown(net->server_fd, SHUT_RDWR);
-  close(net->server_fd);
-  shutdown(net->fd, SHUT_RDWR);
+  close_lanes(net, 0);
+  if (net->server_fd != -1)
+  {
+    shutdown(net->server_fd, SHUT_RDWR);
+    close(net->server_fd);
+  }
+  if (net->fd != -1) shutdown(net->fd, SHUT_RDWR);
+  close_rx_fds(net);
 #endif /* CONFIG_USE_UDP */
-  close(net->fd);
+  if (net->fd != -1) close(net->fd);
+  free(net->tasks);
+  pthread_mutex_destroy(&net->lock);
   return 0;
 }
 
@@ -183,6 +725,9 @@ ssize_t pcie_net_send_buf(pcie_net_t* net, const void* buf, size_t size)
 {
   ssize_t n;
 
+  /* messages sent by lane threads do not interleave with the loop ones */
+  pcie_net_lock(net);
+
 #if (CONFIG_USE_UDP == 1)
  redo_send:
   errno = 0;
@@ -196,13 +741,107 @@ ssize_t pcie_net_send_buf(pcie_net_t* net, const void* buf, size_t size)
     goto redo_send;
   }
 #else
-  n = send(net->fd, buf, size, 0);
+  /* the peer may be gone */
+  n = send(net->fd, buf, size, MSG_NOSIGNAL);
 #endif
 
+  if (n == size) __sync_fetch_and_add(&net->tx_seq, (uint64_t)size);
+
+  pcie_net_unlock(net);
+
   if (n != size) { PERROR(); return -1; }
   return 0;
 }
 
+int pcie_net_send_iov(pcie_net_t* net, struct iovec* iov, size_t iovcnt)
+{
+  /* gather send, iov is modified. the iovecs may hold several messages,
+     each one starting with its own iovec. with TCP they are sent in one
+     call. with UDP, one datagram per message.
+   */
+
+  struct msghdr mh;
+  ssize_t n;
+  uint64_t total = 0;
+  size_t j;
+
+  memset(&mh, 0, sizeof(mh));
+
+  for (j = 0; j != iovcnt; ++j) total += iov[j].iov_len;
+
+  /* the messages are sent as a whole, refer to pcie_net_send_buf */
+  pcie_net_lock(net);
+
+#if (CONFIG_USE_UDP == 1)
+  while (iovcnt)
+  {
+    const pcie_net_header_t* const h = (const pcie_net_header_t*)iov->iov_base;
+    size_t size = 0;
+    size_t i;
+
+    for (i = 0; (i != iovcnt) && (size < h->size); ++i)
+      size += iov[i].iov_len;
+
+    mh.msg_iov = iov;
+    mh.msg_iovlen = i;
+    if (sendmsg(net->fd, &mh, 0) != (ssize_t)size) goto on_error;
+
+    iov += i;
+    iovcnt -= i;
+  }
+#endif
+
+  while (iovcnt)
+  {
+    mh.msg_iov = iov;
+    mh.msg_iovlen = iovcnt;
+
+    n = sendmsg(net->fd, &mh, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue ;
+      goto on_error;
+    }
+
+    /* partial send, skip what was sent */
+    while (iovcnt && ((size_t)n >= iov->iov_len))
+    {
+      n -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+
+    if (iovcnt)
+    {
+      iov->iov_base = (uint8_t*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  __sync_fetch_and_add(&net->tx_seq, total);
+  pcie_net_unlock(net);
+  return 0;
+
+ on_error:
+  pcie_net_unlock(net);
+  PERROR();
+  return -1;
+}
+
+size_t pcie_net_take_fds(pcie_net_t* net, int* fds, size_t max_count)
+{
+  size_t n = net->rx_fd_count;
+
+  if (n > max_count) n = max_count;
+  memcpy(fds, net->rx_fds, n * sizeof(int));
+
+  /* the ones not taken are closed by the next receive */
+  memmove(net->rx_fds, net->rx_fds + n, (net->rx_fd_count - n) * sizeof(int));
+  net->rx_fd_count -= n;
+
+  return n;
+}
+
 ssize_t pcie_net_recv_buf(pcie_net_t* net, void* buf, size_t max_size)
 {
 #if (CONFIG_USE_UDP == 1)
@@ -218,9 +857,9 @@ ssize_t pcie_net_recv_buf(pcie_net_t* net, void* buf, size_t max_size)
   ssize_t n;
   size_t rem_size;
 
-  /* header always comes first */
+  /* header always comes first, with the passed fds if any */
   if (max_size < sizeof(h)) { PERROR(); return -1; }
-  n = recv(net->fd, (void*)&h, sizeof(h), MSG_WAITALL);
+  n = recv_with_fds(net, (void*)&h, sizeof(h));
   if (n != sizeof(h)) { PERROR(); return -1; }
 
   if (h.size > max_size) { PERROR(); return -1; }
@@ -232,35 +871,334 @@ ssize_t pcie_net_recv_buf(pcie_net_t* net, void* buf, size_t max_size)
 #endif /* (CONFIG_USE_UDP == 1) */
 }
 
+/* buffer pool. buffers are carved from cache line aligned slabs, in a
+   few size classes. each thread caches free buffers in per class lists.
+   a thread with too many cached buffers (the one freeing the buffers
+   another thread allocates) gives half of them back to a shared depot,
+   where threads running out of buffers refill by the same amount. an
+   exiting thread gives all of its buffers back. in the steady state, no
+   allocator call is made. larger requests go to malloc directly.
+ */
+
+#define POOL_LINE_SIZE 64
+#define POOL_CLASS_COUNT 3
+#define POOL_SLAB_COUNT 16
+#define POOL_CACHE_MAX 64
+#define POOL_NO_CLASS POOL_CLASS_COUNT
+
+typedef struct pool_buf
+{
+  /* next free buffer, in a cache or in the depot */
+  struct pool_buf* next;
+  volatile unsigned int refs;
+  unsigned int class;
+
+  /* keep user data cache line aligned */
+} __attribute__((aligned(POOL_LINE_SIZE))) pool_buf_t;
+
+/* user data sizes */
+static const size_t pool_sizes[POOL_CLASS_COUNT] =
+{
+  POOL_LINE_SIZE * 2,
+  POOL_LINE_SIZE * 16,
+  POOL_LINE_SIZE * 65
+};
+
+typedef struct pool_cache
+{
+  pool_buf_t* heads[POOL_CLASS_COUNT];
+  size_t counts[POOL_CLASS_COUNT];
+  /* set once the thread exit flush is armed */
+  unsigned int is_armed;
+} pool_cache_t;
+
+static __thread pool_cache_t pool_cache;
+
+/* the key value is the thread cache, refer to pool_arm */
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static struct
+{
+  volatile int lock;
+  pool_buf_t* heads[POOL_CLASS_COUNT];
+} pool_depot;
+
+static inline void pool_lock(void)
+{
+  while (__sync_lock_test_and_set(&pool_depot.lock, 1))
+  {
+    /* the holder may be preempted, give up the cpu */
+    while (pool_depot.lock) sched_yield();
+  }
+}
+
+static inline void pool_unlock(void)
+{
+  __sync_lock_release(&pool_depot.lock);
+}
+
+static pool_buf_t* pool_new_slab(unsigned int class)
+{
+  /* new buffers, linked together */
+
+  const size_t size = sizeof(pool_buf_t) + pool_sizes[class];
+  uint8_t* slab;
+  pool_buf_t* head = NULL;
+  size_t i;
+
+  if (posix_memalign((void**)&slab, POOL_LINE_SIZE, size * POOL_SLAB_COUNT))
+    return NULL;
+
+  for (i = 0; i < POOL_SLAB_COUNT; ++i)
+  {
+    pool_buf_t* const b = (pool_buf_t*)(slab + i * size);
+    b->class = class;
+    b->next = head;
+    head = b;
+  }
+
+  return head;
+}
+
+static int pool_refill(pool_cache_t* c, unsigned int class)
+{
+  /* take up to half a cache from the depot, or a new slab. the cache
+     is then below POOL_CACHE_MAX, whatever the depot holds.
+   */
+
+  pool_buf_t* head;
+  pool_buf_t* tail;
+  size_t n = 0;
+
+  pool_lock();
+  head = pool_depot.heads[class];
+  if (head != NULL)
+  {
+    for (tail = head, n = 1; (n < POOL_CACHE_MAX / 2) && tail->next; ++n)
+      tail = tail->next;
+    pool_depot.heads[class] = tail->next;
+    tail->next = NULL;
+  }
+  pool_unlock();
+
+  if (head == NULL)
+  {
+    head = pool_new_slab(class);
+    if (head == NULL) return -1;
+    n = POOL_SLAB_COUNT;
+  }
+
+  c->heads[class] = head;
+  c->counts[class] = n;
+
+  return 0;
+}
+
+static void pool_drain(pool_cache_t* c, unsigned int class)
+{
+  /* give half of the cached buffers back to the depot */
+
+  pool_buf_t* head = c->heads[class];
+  pool_buf_t* tail = head;
+  size_t i;
+
+  for (i = 1; i < POOL_CACHE_MAX / 2; ++i) tail = tail->next;
+
+  c->heads[class] = tail->next;
+  c->counts[class] -= POOL_CACHE_MAX / 2;
+
+  pool_lock();
+  tail->next = pool_depot.heads[class];
+  pool_depot.heads[class] = head;
+  pool_unlock();
+}
+
+static void pool_flush(void* opak)
+{
+  /* thread exit, give all of the cached buffers back to the depot */
+
+  pool_cache_t* const c = (pool_cache_t*)opak;
+  pool_buf_t* tail;
+  unsigned int class;
+
+  for (class = 0; class != POOL_CLASS_COUNT; ++class)
+  {
+    if (c->heads[class] == NULL) continue ;
+
+    for (tail = c->heads[class]; tail->next != NULL; tail = tail->next) ;
+
+    pool_lock();
+    tail->next = pool_depot.heads[class];
+    pool_depot.heads[class] = c->heads[class];
+    pool_unlock();
+
+    c->heads[class] = NULL;
+    c->counts[class] = 0;
+  }
+}
+
+static void pool_init_key(void)
+{
+  if (pthread_key_create(&pool_key, pool_flush)) PERROR();
+}
+
+static void pool_arm(pool_cache_t* c)
+{
+  /* the key destructor only runs for a non NULL value */
+
+  c->is_armed = 1;
+  pthread_once(&pool_once, pool_init_key);
+  if (pthread_setspecific(pool_key, c)) PERROR();
+}
+
+void* pcie_net_alloc_buf(size_t size)
+{
+  pool_cache_t* const c = &pool_cache;
+  pool_buf_t* b;
+  unsigned int class;
+
+  for (class = 0; class < POOL_CLASS_COUNT; ++class)
+    if (size <= pool_sizes[class]) break ;
+
+  if (class == POOL_NO_CLASS)
+  {
+    if (posix_memalign((void**)&b, POOL_LINE_SIZE, sizeof(pool_buf_t) + size))
+      return NULL;
+    b->class = POOL_NO_CLASS;
+  }
+  else
+  {
+    if (c->is_armed == 0) pool_arm(c);
+    if ((c->heads[class] == NULL) && pool_refill(c, class)) return NULL;
+    b = c->heads[class];
+    c->heads[class] = b->next;
+    --c->counts[class];
+  }
+
+  b->refs = 1;
+
+  return (void*)(b + 1);
+}
+
+void pcie_net_hold_buf(void* p)
+{
+  pool_buf_t* const b = (pool_buf_t*)p - 1;
+  __sync_add_and_fetch(&b->refs, 1);
+}
+
+void pcie_net_free_buf(void* p)
+{
+  pool_cache_t* const c = &pool_cache;
+  pool_buf_t* const b = (pool_buf_t*)p - 1;
+  const unsigned int class = b->class;
+
+  if (__sync_sub_and_fetch(&b->refs, 1)) return ;
+
+  if (class == POOL_NO_CLASS)
+  {
+    free(b);
+    return ;
+  }
+
+  if (c->is_armed == 0) pool_arm(c);
+
+  b->next = c->heads[class];
+  c->heads[class] = b;
+  if (++c->counts[class] >= POOL_CACHE_MAX) pool_drain(c, class);
+}
+
+static unsigned int close_peer(pcie_net_t* net)
+{
+  /* return 1 if the loop stops: udp has no connection, a forked child
+     serves one session only.
+   */
+
+#if (CONFIG_USE_UDP == 1)
+  return 1;
+#else
+  if (net->fork_server || (net->server_fd == -1)) return 1;
+
+  PRINTF("peer closed\n");
+
+  /* the lane threads call the handler, stop them first */
+  close_lanes(net, 0);
+
+  shutdown(net->fd, SHUT_RDWR);
+  close(net->fd);
+  net->fd = -1;
+  close_rx_fds(net);
+
+  if (net->close_fn != NULL) net->close_fn(net->close_data);
+
+  return 0;
+#endif /* CONFIG_USE_UDP */
+}
+
+static unsigned int has_pending_msg(pcie_net_t* net)
+{
+  int n = 0;
+  if (ioctl(net->fd, FIONREAD, &n)) return 0;
+  return n > 0;
+}
+
 int pcie_net_loop(pcie_net_t* net, pcie_net_recvfn_t on_msg_recv, void* opak)
 {
   pcie_net_msg_t* msg;
   pcie_net_reply_t reply;
+  struct timeval tm_buf;
   struct timeval* tm;
   fd_set rfds;
   int err;
   int max_fd;
+  size_t i;
   unsigned int must_stop;
 
-  if ((msg = malloc(PCIE_NET_MSG_MAX_SIZE)) == NULL) return -1;
+  /* in fork server mode, this is where sessions are forked */
+  if (pcie_net_accept(net)) return -1;
+
+  if ((msg = pcie_net_alloc_buf(PCIE_NET_MSG_MAX_SIZE)) == NULL) return -1;
+
+  net->recv_fn = on_msg_recv;
+  net->recv_data = opak;
+
+  net->loop_thread = pthread_self();
+  net->is_looping = 1;
 
   while (1)
   {
-    tm = NULL;
-    if (net->task_fn != NULL) tm = &net->task_tm;
+    tm = get_task_timeout(net, &tm_buf);
 
     FD_ZERO(&rfds);
+    max_fd = -1;
 
-    FD_SET(net->fd, &rfds);
-    max_fd = net->fd;
+    if (net->fd != -1)
+    {
+      FD_SET(net->fd, &rfds);
+      max_fd = net->fd;
+    }
 
     if (net->ev_fd != -1)
     {
       FD_SET(net->ev_fd, &rfds);
-      if (net->fd < net->ev_fd) max_fd = net->ev_fd;
+      if (max_fd < net->ev_fd) max_fd = net->ev_fd;
+    }
+
+    for (i = 0; i != net->watch_count; ++i)
+    {
+      FD_SET(net->watches[i].fd, &rfds);
+      if (max_fd < net->watches[i].fd) max_fd = net->watches[i].fd;
     }
 
-    /* FIXME: manpage says tm should not be considered updated */
+#if (CONFIG_USE_UDP == 0)
+    /* lanes, or the next peer */
+    if ((net->lane_max || (net->fd == -1)) && (net->server_fd != -1))
+    {
+      FD_SET(net->server_fd, &rfds);
+      if (max_fd < net->server_fd) max_fd = net->server_fd;
+    }
+#endif
+
     err = select(max_fd + 1, &rfds, NULL, NULL, tm);
     if (err < 0)
     {
@@ -269,23 +1207,24 @@ int pcie_net_loop(pcie_net_t* net, pcie_net_recvfn_t on_msg_recv, void* opak)
     }
     else if (err == 0)
     {
-      /* timeout elapsed, task to execute */
-      pcie_net_taskfn_t fn = net->task_fn;
-      /* set to NULL before executing, in case of reloading */
-      net->task_fn = NULL;
-      fn(net->task_data);
+      /* idle, fast forward to the next deadline */
+      if (net->time_mode == PCIE_NET_TIME_VIRTUAL)
+	pcie_net_wait_ns(net, get_next_deadline(net));
+
+      /* timeout elapsed, tasks to execute */
+      run_due_tasks(net);
     }
     else /* something to read, either network or event */
     {
       must_stop = 0;
 
-      if (FD_ISSET(net->fd, &rfds))
+      if ((net->fd != -1) && FD_ISSET(net->fd, &rfds))
       {
 	err = pcie_net_recv_msg(net, msg);
 	if (err == -1)
 	{
 	  PERROR();
-	  must_stop = 1;
+	  must_stop = close_peer(net);
 	}
 	else if (err != 1) /* not icmp_unreachable case */
 	{
@@ -295,13 +1234,13 @@ int pcie_net_loop(pcie_net_t* net, pcie_net_recvfn_t on_msg_recv, void* opak)
 	    if (pcie_net_send_reply(net, &reply) == -1)
 	    {
 	      PERROR();
-	      must_stop = 1;
+	      must_stop = close_peer(net);
 	    }
 	  }
 	} 
       } /* socket fd was set */
 
-      if (FD_ISSET(net->ev_fd, &rfds))
+      if ((net->ev_fd != -1) && FD_ISSET(net->ev_fd, &rfds))
       {
 	unsigned int buf[32];
 	ssize_t n;
@@ -317,13 +1256,55 @@ int pcie_net_loop(pcie_net_t* net, pcie_net_recvfn_t on_msg_recv, void* opak)
 	}
       } /* event fd was set */
 
+#if (CONFIG_USE_UDP == 0)
+      if ((net->server_fd != -1) && FD_ISSET(net->server_fd, &rfds))
+      {
+	if (net->fd == -1) accept_peer(net);
+	else accept_lane(net);
+      }
+#endif
+
+      /* watched fds wait for the socket to be drained. they stay
+	 readable until served.
+       */
+      if ((must_stop == 0) && (has_pending_msg(net) == 0))
+      {
+	for (i = 0; i != net->watch_count; ++i)
+	{
+	  const pcie_net_watch_t* const w = &net->watches[i];
+	  if (FD_ISSET(w->fd, &rfds)) w->fn(w->fd, w->data);
+	}
+      }
+
       if (must_stop) break ;
 
+      /* deadlines may have elapsed meanwhile */
+      run_due_tasks(net);
+
     } /* something to read */
   } /* while (1) */
 
-  free(msg);
+  net->is_looping = 0;
+
+  pcie_net_free_buf(msg);
+
+  return 0;
+}
+
+void pcie_net_set_close(pcie_net_t* net, pcie_net_closefn_t fn, void* data)
+{
+  net->close_fn = fn;
+  net->close_data = data;
+}
 
+int pcie_net_set_lanes(pcie_net_t* net, size_t n)
+{
+#if (CONFIG_USE_UDP == 1)
+  if (n) { PERROR(); return -1; }
+#else
+  if (n > PCIE_NET_LANE_COUNT) { PERROR(); return -1; }
+  net->lane_max = n;
+#endif
   return 0;
 }
 
@@ -335,9 +1316,38 @@ int pcie_net_add_task
  void* data
 )
 {
-  net->task_tm = *tm;
-  net->task_fn = fn;
-  net->task_data = data;
+  /* tm is relative to now. any thread, refer to pcie_net_set_lanes. */
+
+  pcie_net_task_t* t;
+  struct timeval scaled_tm;
+
+  pcie_net_lock(net);
+
+  if (net->task_count == net->task_max)
+  {
+    const size_t max = net->task_max ? net->task_max * 2 : 32;
+    t = realloc(net->tasks, max * sizeof(pcie_net_task_t));
+    if (t == NULL)
+    {
+      pcie_net_unlock(net);
+      PERROR();
+      return -1;
+    }
+    net->tasks = t;
+    net->task_max = max;
+  }
+
+  t = &net->tasks[net->task_count];
+  get_now(net, &t->tm);
+  scale_time(net, tm, &scaled_tm);
+  timeradd(&t->tm, &scaled_tm, &t->tm);
+  t->fn = fn;
+  t->data = data;
+
+  task_heap_up(net, net->task_count++);
+
+  pcie_net_unlock(net);
+
   return 0;
 }
 
@@ -354,3 +1364,89 @@ int pcie_net_add_ev
   net->ev_data = data;
   return 0;
 }
+
+int pcie_net_add_fd(pcie_net_t* net, int fd, pcie_net_fdfn_t fn, void* data)
+{
+  pcie_net_watch_t* w;
+
+  if (net->watch_count == PCIE_NET_WATCH_COUNT) { PERROR(); return -1; }
+
+  w = &net->watches[net->watch_count++];
+  w->fd = fd;
+  w->fn = fn;
+  w->data = data;
+
+  return 0;
+}
+
+void pcie_net_del_fd(pcie_net_t* net, int fd)
+{
+  size_t i;
+
+  for (i = 0; i != net->watch_count; ++i)
+  {
+    if (net->watches[i].fd != fd) continue ;
+    net->watches[i] = net->watches[--net->watch_count];
+    break ;
+  }
+}
+
+int pcie_net_set_time(pcie_net_t* net, unsigned int mode, double scale)
+{
+  /* the virtual clock starts from the current real time. pending task
+     deadlines are kept as is, set the mode before adding tasks.
+   */
+
+  if (scale < 0) return -1;
+
+  if ((mode == PCIE_NET_TIME_VIRTUAL) && (net->time_mode != mode))
+    net->vtime = get_real_ns();
+
+  net->time_mode = mode;
+  net->time_scale = scale;
+
+  return 0;
+}
+
+void pcie_net_get_time(pcie_net_t* net, struct timeval* tm)
+{
+  get_now(net, tm);
+}
+
+uint64_t pcie_net_get_ns(pcie_net_t* net)
+{
+  if (net->time_mode == PCIE_NET_TIME_VIRTUAL) return get_vtime(net);
+  return get_real_ns();
+}
+
+void pcie_net_wait_ns(pcie_net_t* net, uint64_t deadline)
+{
+  /* wait until the clock reaches deadline. the virtual clock jumps. */
+
+  uint64_t now;
+
+  if (net->time_mode == PCIE_NET_TIME_VIRTUAL)
+  {
+    /* the clock only moves forward, whatever the thread */
+    while (1)
+    {
+      now = get_vtime(net);
+      if (now >= deadline) break ;
+      if (__sync_bool_compare_and_swap(&net->vtime, now, deadline)) break ;
+    }
+    return ;
+  }
+
+  while ((now = get_real_ns()) < deadline)
+  {
+    /* sleep if long enough, spin otherwise */
+    if ((deadline - now) > 100000)
+    {
+      const uint64_t ns = deadline - now - 50000;
+      struct timespec ts;
+      ts.tv_sec = ns / 1000000000;
+      ts.tv_nsec = ns % 1000000000;
+      nanosleep(&ts, NULL);
+    }
+  }
+}
@@ -6,6 +6,13 @@
 #include <stddef.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 
 typedef struct pcie_net_header
@@ -29,9 +36,61 @@ typedef struct pcie_net_msg
 #define PCIE_NET_OP_INT 6
 #define PCIE_NET_OP_MSI 7
 #define PCIE_NET_OP_MSIX 8
+  /* atomic operations on host memory, device to host. width is the
+     operand size (4 or 8), data holds the operands: the addend, the
+     value to swap, or the value to compare followed by the value to
+     swap. the host replies with an ATOMIC_CPL message.
+   */
+#define PCIE_NET_OP_ATOMIC_FETCHADD 9
+#define PCIE_NET_OP_ATOMIC_SWAP 10
+#define PCIE_NET_OP_ATOMIC_CAS 11
+  /* data holds the original value, bar the status (0 for success) */
+#define PCIE_NET_OP_ATOMIC_CPL 12
+  /* host to device, at connect time. the device answers with the
+     whole config image in a PROBE_CONFIG message at addr 0, the bar
+     range attributes in a PROBE_ATTR message (pcie_net_attr_t array),
+     then PROBE_DONE holding a pcie_net_probe_t.
+   */
+#define PCIE_NET_OP_PROBE 13
+#define PCIE_NET_OP_PROBE_CONFIG 14
+#define PCIE_NET_OP_PROBE_DONE 15
+#define PCIE_NET_OP_PROBE_ATTR 16
+  /* host to device, over unix sockets. data holds pcie_net_mem_map_t
+     entries, each one with its fd passed along the message. it replaces
+     the previous map, an empty one unmaps all. the device then writes
+     mapped host memory directly, and sends MEM_SYNC with the written
+     size in data so that the host tracks the change. MEM_SYNC keeps
+     the order with messages sent later, such as MSI.
+   */
+#define PCIE_NET_OP_MEM_MAP 17
+#define PCIE_NET_OP_MEM_SYNC 18
+  /* host to device, over unix sockets. data holds the pcie_net_attr_t
+     entries of the function doorbells, each one with the eventfd the
+     host signals instead of forwarding the write. refer to
+     PCIE_NET_ATTR_DOORBELL.
+   */
+#define PCIE_NET_OP_DOORBELL_MAP 19
+  /* host to device, over unix sockets. data holds uint32_t msi vector
+     numbers, each one with the eventfd the host routes to the vector
+     (a kvm irqfd). the device writes it instead of sending MSI. it
+     replaces the previous map, an empty one goes back to messages.
+   */
+#define PCIE_NET_OP_IRQFD_MAP 20
+  /* host to device, first message of a lane: an extra connection that
+     carries the memory accesses of one host cpu, addr being the lane
+     index. each lane is served by its own device thread. all its
+     replies are pcie_net_lane_reply_t, the first one accepting the
+     lane. a device not accepting lanes closes the connection. sent
+     again on the lane, it is a fence: the reply comes once the device
+     processed the previous lane messages, writes included.
+   */
+#define PCIE_NET_OP_LANE 21
 
   uint8_t op; /* in PCIE_NET_OP_XXX */
-  uint8_t bar; /* in [0:5] */
+  /* bar in [0:5], function number in the upper bits */
+#define PCIE_NET_BAR_MASK 0x07
+#define PCIE_NET_FUNC_SHIFT 3
+  uint8_t bar;
   uint8_t width; /* access in 1, 2, 4, 8 */
   uint64_t addr;
   uint16_t size; /* data size, in bytes */
@@ -46,6 +105,64 @@ typedef struct pcie_net_reply
   uint8_t data[8];
 } __attribute__((packed)) pcie_net_reply_t;
 
+/* reply sent on a lane. seq is the count of bytes the device had sent
+   on the main connection, the host processes them before completing
+   the access so that a read does not pass earlier device writes.
+ */
+typedef struct pcie_net_lane_reply
+{
+  pcie_net_header_t header;
+  uint8_t status;
+  uint8_t data[8];
+  uint64_t seq;
+} __attribute__((packed)) pcie_net_lane_reply_t;
+
+/* PROBE_DONE payload */
+typedef struct pcie_net_probe
+{
+  /* bar registers as read after writing all ones, 0 if unused. the
+     upper half of a 64 bits bar is in the next register.
+   */
+  uint32_t bar_mask[6];
+  /* config dwords the device changes on its own, one bit per dword.
+     the host must not cache them.
+   */
+#define PCIE_NET_CONFIG_DWORDS (0x1000 / 4)
+  uint32_t volatile_map[PCIE_NET_CONFIG_DWORDS / 32];
+} __attribute__((packed)) pcie_net_probe_t;
+
+/* PROBE_ATTR entry, attributes of a bar range */
+typedef struct pcie_net_attr
+{
+  /* the value never changes, the host reads it once */
+#define PCIE_NET_ATTR_CONST (1 << 0)
+  /* only host writes change the value, the host caches it until then */
+#define PCIE_NET_ATTR_CACHEABLE (1 << 1)
+  /* write only, the host reads 0 without asking the device */
+#define PCIE_NET_ATTR_WO (1 << 2)
+  /* contiguous writes can be buffered by the host, then sent as one
+     WRITE_MEM burst whose size is a multiple of width. the burst is
+     flushed before any read or config access, or after a short delay.
+   */
+#define PCIE_NET_ATTR_WC (1 << 3)
+  /* a write only signals the device, the value is not used. the host
+     can signal an eventfd passed in DOORBELL_MAP instead of sending it.
+   */
+#define PCIE_NET_ATTR_DOORBELL (1 << 4)
+  uint8_t attr;
+  uint8_t bar;
+  uint64_t addr;
+  uint64_t size;
+} __attribute__((packed)) pcie_net_attr_t;
+
+/* MEM_MAP entry, host memory at addr is at off in the passed fd */
+typedef struct pcie_net_mem_map
+{
+  uint64_t addr;
+  uint64_t size;
+  uint64_t off;
+} __attribute__((packed)) pcie_net_mem_map_t;
+
 struct pcie_net;
 
 /* return 1 if a reply must be sent */
@@ -56,6 +173,35 @@ typedef void (*pcie_net_taskfn_t)(void*);
 
 typedef int (*pcie_net_evfn_t)(unsigned int, void*);
 
+/* fd, opaque */
+typedef void (*pcie_net_fdfn_t)(int, void*);
+
+typedef void (*pcie_net_closefn_t)(void*);
+
+typedef struct pcie_net_watch
+{
+  int fd;
+  pcie_net_fdfn_t fn;
+  void* data;
+} pcie_net_watch_t;
+
+typedef struct pcie_net_lane
+{
+  struct pcie_net* net;
+  int fd;
+  pthread_t thread;
+  /* set by the thread when the lane is closed */
+  volatile unsigned int is_done;
+} pcie_net_lane_t;
+
+typedef struct pcie_net_task
+{
+  /* absolute deadline */
+  struct timeval tm;
+  pcie_net_taskfn_t fn;
+  void* data;
+} pcie_net_task_t;
+
 typedef struct pcie_net
 {
 #if (CONFIG_USE_UDP == 0)
@@ -63,31 +209,161 @@ typedef struct pcie_net
   int server_fd;
 #endif
 
-  /* peer socket fd */
+  /* peer socket fd, -1 until accepted in fork server mode, and between
+     peers otherwise
+   */
   int fd;
 
+  /* fds passed with the last message, unix sockets only */
+#define PCIE_NET_FD_COUNT 8
+  int rx_fds[PCIE_NET_FD_COUNT];
+  size_t rx_fd_count;
+
+  /* bytes sent on fd, refer to pcie_net_lane_reply_t */
+  volatile uint64_t tx_seq;
+
+  /* runtime lock, recursive, refer to pcie_net_lock. it serializes the
+     task heap, the sends on fd and the virtual clock.
+   */
+  pthread_mutex_t lock;
+
+  /* thread running pcie_net_loop, valid if is_looping */
+  pthread_t loop_thread;
+  volatile unsigned int is_looping;
+
+  /* extra connections, refer to pcie_net_set_lanes */
+#define PCIE_NET_LANE_COUNT 32
+  pcie_net_lane_t lanes[PCIE_NET_LANE_COUNT];
+  size_t lane_count;
+  size_t lane_max;
+  /* pcie_net_loop handler, called by the lane threads too */
+  pcie_net_recvfn_t recv_fn;
+  void* recv_data;
+
+  /* fork a child per accepted connection, refer to pcie_net_accept */
+  unsigned int fork_server;
+
+  /* peer closed, refer to pcie_net_set_close */
+  pcie_net_closefn_t close_fn;
+  void* close_data;
+
   /* event */
   int ev_fd;
   pcie_net_evfn_t ev_fn;
   void* ev_data;
 
-  /* next task to be scheduled */
-  struct timeval task_tm;
-  pcie_net_taskfn_t task_fn;
-  void* task_data;
+  /* other readable fds, refer to pcie_net_add_fd */
+#define PCIE_NET_WATCH_COUNT 32
+  pcie_net_watch_t watches[PCIE_NET_WATCH_COUNT];
+  size_t watch_count;
+
+  /* clock used by tasks, refer to pcie_net_set_time */
+#define PCIE_NET_TIME_REAL 0
+#define PCIE_NET_TIME_VIRTUAL 1
+  unsigned int time_mode;
+  /* task delays are multiplied by time_scale */
+  double time_scale;
+  /* current time in nanoseconds, in PCIE_NET_TIME_VIRTUAL mode */
+  uint64_t vtime;
+
+  /* pending tasks, binary heap ordered by deadline */
+  pcie_net_task_t* tasks;
+  size_t task_count;
+  size_t task_max;
 
 } pcie_net_t;
 
 
+/* laddr is either an inet address, with lport, or PCIE_NET_UNIX_PREFIX
+   followed by the path of a unix socket. unix sockets can pass fds,
+   refer to pcie_net_take_fds.
+ */
+#define PCIE_NET_UNIX_PREFIX "unix:"
+
 int pcie_net_init
 (pcie_net_t*, const char*, const char*, const char*, const char*);
 int pcie_net_fini(pcie_net_t*);
+
+/* accept the peer connection. with PCIE_NET_FORK=1 in the environment,
+   pcie_net_init only listens and the connection is accepted here, by
+   the first pcie_net_loop or an explicit call. each connection is then
+   served by a child forked from the initialized process, so a session
+   starts without paying for the device initialization again. it
+   returns 0 in the child, the parent keeps accepting.
+ */
+int pcie_net_accept(pcie_net_t*);
 int pcie_net_loop(pcie_net_t*, pcie_net_recvfn_t, void*);
+
+/* when the peer closes the connection, pcie_net_loop drops its lanes,
+   calls fn and waits for the next peer, a restarted host for instance.
+   tasks keep running meanwhile and their messages fail. a forked child
+   returns instead, its session is over.
+ */
+void pcie_net_set_close(pcie_net_t*, pcie_net_closefn_t, void*);
+
+/* accept up to n lanes (0 by default), refer to PCIE_NET_OP_LANE. the
+   pcie_net_loop handler is then called by the lane threads for memory
+   and io accesses, concurrently with the loop thread and each other.
+   tasks can be added and messages sent from any thread, the runtime
+   serializes them. the device protects its own state. replies must
+   not be delayed.
+ */
+int pcie_net_set_lanes(pcie_net_t*, size_t);
 int pcie_net_add_task
 (pcie_net_t*, const struct timeval*, pcie_net_taskfn_t, void*);
 int pcie_net_add_ev
 (pcie_net_t*, int, pcie_net_evfn_t, void*);
+
+/* call fn when fd is readable. watched fds are served once the received
+   messages are processed, so that a signal does not overtake writes
+   sent before it. the fd is not closed by pcie_net_del_fd.
+ */
+int pcie_net_add_fd(pcie_net_t*, int, pcie_net_fdfn_t, void*);
+void pcie_net_del_fd(pcie_net_t*, int);
+int pcie_net_set_time(pcie_net_t*, unsigned int, double);
+void pcie_net_get_time(pcie_net_t*, struct timeval*);
+uint64_t pcie_net_get_ns(pcie_net_t*);
+void pcie_net_wait_ns(pcie_net_t*, uint64_t);
+
+/* runtime lock, for the state layered above pcie_net that lane threads
+   share with the loop. it is recursive, and it is taken around the
+   task heap and the sends, never around handlers or tasks.
+ */
+static inline void pcie_net_lock(pcie_net_t* net)
+{
+  pthread_mutex_lock(&net->lock);
+}
+
+static inline void pcie_net_unlock(pcie_net_t* net)
+{
+  pthread_mutex_unlock(&net->lock);
+}
+
+/* 1 if called from the thread running pcie_net_loop (tasks, handlers of
+   the main connection), so that a wait on the loop would never end.
+ */
+static inline unsigned int pcie_net_is_loop_thread(pcie_net_t* net)
+{
+  return net->is_looping && pthread_equal(net->loop_thread, pthread_self());
+}
 ssize_t pcie_net_send_buf(pcie_net_t*, const void*, size_t);
+int pcie_net_send_iov(pcie_net_t*, struct iovec*, size_t);
+
+/* pooled buffers, cache line aligned. they can be allocated and freed
+   from any thread, without allocator calls once the pool is warm. a
+   buffer starts with one reference, hold adds one, free drops one and
+   releases the buffer when no reference is left.
+ */
+
+void* pcie_net_alloc_buf(size_t);
+void pcie_net_hold_buf(void*);
+void pcie_net_free_buf(void*);
+
+static inline pcie_net_msg_t* pcie_net_alloc_msg(size_t data_size)
+{
+  return (pcie_net_msg_t*)pcie_net_alloc_buf
+    (offsetof(pcie_net_msg_t, data) + data_size);
+}
 
 static inline int pcie_net_send_msg(pcie_net_t* n, pcie_net_msg_t* m)
 {
@@ -104,6 +380,11 @@ static inline int pcie_net_send_reply(pcie_net_t* n, pcie_net_reply_t* r)
 
 ssize_t pcie_net_recv_buf(pcie_net_t*, void*, size_t);
 
+/* take up to n fds passed with the message being processed. the caller
+   owns them, the others are closed when the next message is received.
+ */
+size_t pcie_net_take_fds(pcie_net_t*, int*, size_t);
+
 static inline int pcie_net_recv_msg(pcie_net_t* net, pcie_net_msg_t* m)
 {
   /* -1 for error, 0 for success, 1 for neither a message, nor an error */
@@ -124,4 +405,9 @@ static inline int pcie_net_recv_reply(pcie_net_t* net, pcie_net_reply_t* r)
 }
 
 
+#ifdef __cplusplus
+}
+#endif
+
+
 #endif /* PCIE_NET_H_INCLUDED */
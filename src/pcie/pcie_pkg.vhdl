@@ -23,6 +23,9 @@ component endpoint is
   req_bar: out std_ulogic_vector(BAR_WIDTH - 1 downto 0);
   req_addr: out std_ulogic_vector(ADDR_WIDTH - 1 downto 0);
   req_data: out std_ulogic_vector(DATA_WIDTH - 1 downto 0);
+  -- access size in bytes (1, 2, 4 or 8). data in the low order bytes,
+  -- rep_data too.
+  req_size: out std_ulogic_vector(SIZE_WIDTH - 1 downto 0);
 
   rep_en: in std_ulogic;
   rep_data: in std_ulogic_vector(DATA_WIDTH - 1 downto 0);
@@ -0,0 +1,486 @@
+#ifndef VPCIE_HPP_INCLUDED
+# define VPCIE_HPP_INCLUDED
+
+
+/* header only C++ device layer on top of pcie.h. requires C++20.
+
+   a device is described by a config space and a set of bars, each one
+   backed by a register map known at compile time:
+
+   struct ctl : vpcie::reg<0x00, vpcie::access::action> {};
+   struct sta : vpcie::reg<0x04, vpcie::access::ro> {};
+   using regs = vpcie::regmap<ctl, sta>;
+   using conf = vpcie::config<0x2a2a, 0x2b2b>;
+
+   struct dma : vpcie::device<dma, conf, vpcie::bar<1, regs>>
+   {
+     void on_write(ctl, uint32_t x) { ... }
+   };
+
+   the runtime calls a per bar trampoline. from there, register decode
+   and model hooks are resolved statically and can be inlined. the
+   underlying pcie_dev_t is kept, so C and C++ models share the runtime.
+ */
+
+
+#include <array>
+#include <tuple>
+#include <span>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <concepts>
+#include <algorithm>
+#include <type_traits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstddef>
+#include <cstring>
+#include "pcie.h"
+#include "pcie_net.h"
+
+
+namespace vpcie
+{
+
+/* register access type, same semantic as PCIE_REG_XXX */
+
+enum class access : uint32_t
+{
+  ro = PCIE_REG_RO,
+  rw = PCIE_REG_RW,
+  w1c = PCIE_REG_W1C,
+  action = PCIE_REG_ACTION
+};
+
+template<uint32_t Addr, access Access, uint32_t Reset = 0>
+struct reg
+{
+  static_assert((Addr % sizeof(uint32_t)) == 0, "unaligned register");
+
+  static constexpr uint32_t addr = Addr;
+  static constexpr size_t index = Addr / sizeof(uint32_t);
+  static constexpr access type = Access;
+  static constexpr uint32_t reset = Reset;
+};
+
+/* model hook detection. hooks are overloaded on the register type. */
+
+template<typename Model, typename Reg>
+concept has_read_hook = requires (Model& m)
+{
+  { m.on_read(Reg{}) } -> std::convertible_to<uint32_t>;
+};
+
+template<typename Model, typename Reg>
+concept has_write_hook = requires (Model& m, uint32_t x)
+{
+  m.on_write(Reg{}, x);
+};
+
+template<typename... Regs>
+struct regmap
+{
+  static constexpr size_t count = std::max({ Regs::index... }) + 1;
+
+  typedef std::array<uint32_t, count> vals_type;
+
+  static constexpr vals_type reset_image()
+  {
+    vals_type vals{};
+    for (auto& x : vals) x = (uint32_t)-1;
+    ((vals[Regs::index] = Regs::reset), ...);
+    return vals;
+  }
+
+  template<typename Reg>
+  static constexpr bool contains = (std::is_same_v<Reg, Regs> || ...);
+
+  template<typename Model>
+  static uint32_t read(Model& m, const vals_type& vals, size_t i)
+  {
+    uint32_t x = (uint32_t)-1;
+    ((i == Regs::index ? (x = read_one<Model, Regs>(m, vals), true) : false)
+     || ...);
+    return x;
+  }
+
+  /* a write stores the registers it covers, then calls their hooks */
+
+  static void store(vals_type& vals, size_t i, uint32_t x, uint32_t mask)
+  {
+    ((i == Regs::index ? (store_one<Regs>(vals, x, mask), true) : false)
+     || ...);
+  }
+
+  template<typename Model>
+  static void notify(Model& m, const vals_type& vals, size_t i)
+  {
+    ((i == Regs::index ? (notify_one<Model, Regs>(m, vals), true) : false)
+     || ...);
+  }
+
+private:
+
+  template<typename Model, typename Reg>
+  static inline uint32_t read_one(Model& m, const vals_type& vals)
+  {
+    if constexpr (has_read_hook<Model, Reg>) return m.on_read(Reg{});
+    else return vals[Reg::index];
+  }
+
+  template<typename Reg>
+  static inline void store_one(vals_type& vals, uint32_t x, uint32_t mask)
+  {
+    uint32_t& r = vals[Reg::index];
+
+    if constexpr (Reg::type == access::ro) return ;
+    else if constexpr (Reg::type == access::w1c) r &= ~(x & mask);
+    else r = (r & ~mask) | (x & mask);
+  }
+
+  template<typename Model, typename Reg>
+  static inline void notify_one(Model& m, const vals_type& vals)
+  {
+    if constexpr (Reg::type == access::action)
+    {
+      static_assert(has_write_hook<Model, Reg>, "action without on_write");
+    }
+
+    if constexpr (Reg::type == access::ro) return ;
+    else if constexpr (has_write_hook<Model, Reg>) m.on_write(Reg{}, vals[Reg::index]);
+  }
+};
+
+/* size defaults to the smallest power of 2 covering the registers */
+
+constexpr size_t bar_size_for(size_t nbytes)
+{
+  size_t size = 0x10;
+  while (size < nbytes) size <<= 1;
+  return size;
+}
+
+template<unsigned int Index, typename Map, size_t Size = 0>
+struct bar
+{
+  static_assert(Index < PCIE_BAR_COUNT, "invalid bar index");
+
+  static constexpr unsigned int index = Index;
+  static constexpr size_t size =
+    Size ? Size : bar_size_for(Map::count * sizeof(uint32_t));
+
+  typedef Map map_type;
+};
+
+/* config space header image, applied at init time */
+
+template
+<
+ uint16_t VendorId,
+ uint16_t DeviceId,
+ uint32_t ClassCode = PCI_CLASS_SIGNAL_OTHER << 8,
+ uint8_t Revision = 0,
+ uint16_t SubVendorId = 0,
+ uint16_t SubDeviceId = 0
+>
+struct config
+{
+  static constexpr size_t size = 0x40;
+
+  struct image_type
+  {
+    std::array<uint8_t, size> data;
+    std::array<uint8_t, size> mask;
+  };
+
+  static constexpr image_type image()
+  {
+    image_type im{};
+
+    auto put = [&im](size_t off, uint32_t x, size_t n)
+    {
+      for (size_t i = 0; i != n; ++i, x >>= 8)
+      {
+	im.data[off + i] = (uint8_t)x;
+	im.mask[off + i] = 0xff;
+      }
+    };
+
+    put(PCI_VENDOR_ID, VendorId, 2);
+    put(PCI_DEVICE_ID, DeviceId, 2);
+    put(PCI_CLASS_REVISION, (ClassCode << 8) | Revision, 4);
+    put(PCI_SUBSYSTEM_VENDOR_ID, SubVendorId, 2);
+    put(PCI_SUBSYSTEM_ID, SubDeviceId, 2);
+
+    return im;
+  }
+};
+
+/* payload views over messages */
+
+inline std::span<uint8_t> payload(pcie_net_msg_t& m)
+{
+  return std::span<uint8_t>(m.data, m.size);
+}
+
+inline std::span<const uint8_t> payload(const pcie_net_msg_t& m)
+{
+  return std::span<const uint8_t>(m.data, m.size);
+}
+
+/* move only message buffer, PCIE_NET_MSG_MAX_SIZE bytes from the pool */
+
+class msg_buf
+{
+public:
+
+  static constexpr size_t max_payload =
+    PCIE_NET_MSG_MAX_SIZE - offsetof(pcie_net_msg_t, data);
+
+  msg_buf() : buf_((uint8_t*)pcie_net_alloc_buf(PCIE_NET_MSG_MAX_SIZE)) {}
+
+  msg_buf(const msg_buf&) = delete;
+  msg_buf& operator=(const msg_buf&) = delete;
+  msg_buf(msg_buf&&) noexcept = default;
+  msg_buf& operator=(msg_buf&&) noexcept = default;
+
+  explicit operator bool() const { return buf_ != nullptr; }
+
+  pcie_net_msg_t& msg() { return *(pcie_net_msg_t*)buf_.get(); }
+  const pcie_net_msg_t& msg() const { return *(const pcie_net_msg_t*)buf_.get(); }
+
+  /* whole payload area, whatever the current message size */
+  std::span<uint8_t> room() { return std::span<uint8_t>(msg().data, max_payload); }
+  std::span<uint8_t> payload() { return vpcie::payload(msg()); }
+
+private:
+
+  struct pool_deleter
+  {
+    void operator()(uint8_t* p) const { pcie_net_free_buf(p); }
+  };
+
+  std::unique_ptr<uint8_t[], pool_deleter> buf_;
+};
+
+/* device, Model being the most derived type (CRTP) */
+
+template<typename Model, typename Config, typename... Bars>
+class device
+{
+public:
+
+  device() : vals_{ Bars::map_type::reset_image()... } {}
+
+  device(const device&) = delete;
+  device& operator=(const device&) = delete;
+
+  int init_net
+  (const char* laddr, const char* lport, const char* raddr, const char* rport)
+  {
+    if (pcie_init_net(&dev_, laddr, lport, raddr, rport) == -1) return -1;
+    apply_config();
+    (set_bar<Bars>(), ...);
+    return 0;
+  }
+
+  /* virtual function fn of pf, refer to pcie_init_vf */
+  int init_vf(pcie_dev_t& pf, unsigned int fn)
+  {
+    if (pcie_init_vf(&dev_, &pf, fn) == -1) return -1;
+    apply_config();
+    (set_bar<Bars>(), ...);
+    return 0;
+  }
+
+  int fini() { return pcie_fini(&dev_); }
+  int loop() { return pcie_loop(&dev_); }
+  int send_msi() { return pcie_send_msi(&dev_); }
+
+  /* bar range attributes, attr in PCIE_NET_ATTR_XXX */
+  int set_bar_attr(unsigned int bar, uint64_t addr, uint64_t size, unsigned int attr)
+  {
+    return pcie_set_bar_attr(&dev_, bar, addr, size, attr);
+  }
+
+  /* host cpus served concurrently, refer to pcie_set_lanes */
+  int set_lanes(size_t n) { return pcie_set_lanes(&dev_, n); }
+
+  /* fn called with the model on host writes to the doorbell at addr */
+  template<void (Model::*Fn)()>
+  int set_doorbell(unsigned int bar, uint64_t addr)
+  {
+    return pcie_set_doorbell(&dev_, bar, addr, &doorbell_tramp<Fn>, &model());
+  }
+
+  /* fn called with the model after usecs */
+  template<void (Model::*Fn)()>
+  int add_task(unsigned long usecs)
+  {
+    return pcie_add_task(&dev_, usecs, &task_tramp<Fn>, &model());
+  }
+
+  /* write data to host memory, split in max payload size TLPs */
+  int write_mem(uint64_t addr, std::span<const uint8_t> data)
+  {
+    return pcie_write_mem(&dev_, addr, data.data(), data.size());
+  }
+
+  /* gather variant, one iovec per buffer */
+  int write_mem(uint64_t addr, std::span<const struct iovec> iov, unsigned int flags = 0)
+  {
+    return pcie_dma_write(&dev_, addr, iov.data(), iov.size(), flags);
+  }
+
+  /* atomic operations on host memory, T is uint32_t or uint64_t.
+     return the original value, or std::nullopt on error. they block
+     until the loop delivers the completion: not from the loop thread,
+     refer to pcie_atomic_fetch_add. coroutines use sched::fetch_add.
+   */
+  template<typename T>
+  std::optional<T> fetch_add(uint64_t addr, T x)
+  {
+    static_assert(sizeof(T) == 4 || sizeof(T) == 8, "invalid atomic width");
+    uint64_t old;
+    if (pcie_atomic_fetch_add(&dev_, addr, sizeof(T), x, &old)) return {};
+    return (T)old;
+  }
+
+  template<typename T>
+  std::optional<T> swap(uint64_t addr, T x)
+  {
+    static_assert(sizeof(T) == 4 || sizeof(T) == 8, "invalid atomic width");
+    uint64_t old;
+    if (pcie_atomic_swap(&dev_, addr, sizeof(T), x, &old)) return {};
+    return (T)old;
+  }
+
+  template<typename T>
+  std::optional<T> compare_swap(uint64_t addr, T cmp, T x)
+  {
+    static_assert(sizeof(T) == 4 || sizeof(T) == 8, "invalid atomic width");
+    uint64_t old;
+    if (pcie_atomic_cas(&dev_, addr, sizeof(T), cmp, x, &old)) return {};
+    return (T)old;
+  }
+
+  /* register value, searched in all the bars at compile time */
+  template<typename Reg>
+  uint32_t& reg() { return reg_in<Reg, 0, Bars...>(); }
+
+  pcie_dev_t& dev() { return dev_; }
+
+private:
+
+  pcie_dev_t dev_;
+  std::tuple<typename Bars::map_type::vals_type...> vals_;
+
+  Model& model() { return static_cast<Model&>(*this); }
+
+  void apply_config()
+  {
+    static constexpr auto im = Config::image();
+    for (size_t i = 0; i != Config::size; ++i)
+    {
+      if (im.mask[i] == 0) continue ;
+      pcie_write_config_byte(&dev_, i, im.data[i]);
+    }
+  }
+
+  template<typename Reg, size_t I, typename Bar, typename... Rest>
+  uint32_t& reg_in()
+  {
+    if constexpr (Bar::map_type::template contains<Reg>)
+      return std::get<I>(vals_)[Reg::index];
+    else
+    {
+      static_assert(sizeof...(Rest) != 0, "register not in any bar");
+      return reg_in<Reg, I + 1, Rest...>();
+    }
+  }
+
+  template<typename Bar>
+  static constexpr size_t bar_pos()
+  {
+    constexpr unsigned int indices[] = { Bars::index... };
+    for (size_t i = 0; i != sizeof...(Bars); ++i)
+      if (indices[i] == Bar::index) return i;
+    return 0;
+  }
+
+  template<typename Bar>
+  void set_bar()
+  {
+    pcie_set_bar
+      (&dev_, Bar::index, Bar::size, &read_tramp<Bar>, &write_tramp<Bar>, this);
+  }
+
+  /* runtime entry points, one per bar. decode is static from here. */
+
+  template<typename Bar>
+  static void read_tramp(uint64_t addr, void* data, size_t size, void* opak)
+  {
+    device* const d = static_cast<device*>(opak);
+    auto& vals = std::get<bar_pos<Bar>()>(d->vals_);
+    uint8_t* p = (uint8_t*)data;
+    size_t i = addr / sizeof(uint32_t);
+    size_t off = addr % sizeof(uint32_t);
+
+    while (size)
+    {
+      const size_t n = std::min(sizeof(uint32_t) - off, size);
+      const uint32_t x = Bar::map_type::read(d->model(), vals, i);
+      std::memcpy(p, (const uint8_t*)&x + off, n);
+      p += n;
+      size -= n;
+      off = 0;
+      ++i;
+    }
+  }
+
+  template<typename Bar>
+  static void write_tramp(uint64_t addr, const void* data, size_t size, void* opak)
+  {
+    device* const d = static_cast<device*>(opak);
+    auto& vals = std::get<bar_pos<Bar>()>(d->vals_);
+    const uint8_t* p = (const uint8_t*)data;
+    const size_t first = addr / sizeof(uint32_t);
+    size_t i = first;
+    size_t off = addr % sizeof(uint32_t);
+
+    /* all the registers are stored before the hooks see them */
+    while (size)
+    {
+      const size_t n = std::min(sizeof(uint32_t) - off, size);
+      uint32_t x = 0;
+      uint32_t mask = 0;
+      std::memcpy((uint8_t*)&x + off, p, n);
+      std::memset((uint8_t*)&mask + off, 0xff, n);
+      Bar::map_type::store(vals, i, x, mask);
+      p += n;
+      size -= n;
+      off = 0;
+      ++i;
+    }
+
+    for (size_t j = first; j != i; ++j) Bar::map_type::notify(d->model(), vals, j);
+  }
+
+  template<void (Model::*Fn)()>
+  static void task_tramp(void* opak)
+  {
+    (static_cast<Model*>(opak)->*Fn)();
+  }
+
+  template<void (Model::*Fn)()>
+  static void doorbell_tramp(uint64_t, void* opak)
+  {
+    (static_cast<Model*>(opak)->*Fn)();
+  }
+};
+
+} /* namespace vpcie */
+
+
+#endif /* VPCIE_HPP_INCLUDED */
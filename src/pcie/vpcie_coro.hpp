@@ -0,0 +1,348 @@
+#ifndef VPCIE_CORO_HPP_INCLUDED
+# define VPCIE_CORO_HPP_INCLUDED
+
+
+/* C++20 coroutines on top of the pcie_net event loop. requires C++20.
+
+   a device activity is written as a sequential coroutine:
+
+   vpcie::process channel(vpcie::sched& s, vpcie::event<uint32_t>& start)
+   {
+     while (1)
+     {
+       const uint32_t ctl = co_await start;
+       co_await s.sleep(1000);
+       co_await s.write_mem(addr, data);
+       pcie_send_msi(s.dev());
+     }
+   }
+
+   everything runs on the pcie_loop thread. suspended coroutines are
+   resumed by pcie_net tasks or by the code raising an event, so any
+   number of activities only cost their coroutine frames.
+ */
+
+
+#include <deque>
+#include <vector>
+#include <span>
+#include <optional>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <coroutine>
+#include "pcie.h"
+#include "pcie_net.h"
+
+
+namespace vpcie
+{
+
+/* fire and forget coroutine, the frame is released when it returns */
+
+struct process
+{
+  struct promise_type
+  {
+    process get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+namespace detail
+{
+
+inline void resume_task(void* p)
+{
+  std::coroutine_handle<>::from_address(p).resume();
+}
+
+} /* namespace detail */
+
+/* scheduler, bound to a device */
+
+class sched
+{
+public:
+
+  explicit sched(pcie_dev_t* dev) : dev_(dev) {}
+
+  pcie_dev_t* dev() { return dev_; }
+
+  /* resume after usecs, through pcie_add_task */
+
+  struct sleep_awaiter
+  {
+    sched* s;
+    unsigned long usecs;
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+      if (pcie_add_task(s->dev_, usecs, detail::resume_task, h.address()))
+	std::terminate();
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  sleep_awaiter sleep(unsigned long usecs) { return { this, usecs }; }
+
+  /* let the other activities run, then resume */
+  sleep_awaiter yield() { return { this, 0 }; }
+
+  /* write data to host memory. resumes once the data are sent, other
+     activities run meanwhile. data must be kept until then. await_resume
+     gives 0 on success, -1 on error.
+   */
+
+  struct write_mem_awaiter
+  {
+    sched* s;
+    uint64_t addr;
+    std::span<const uint8_t> data;
+    int err;
+    std::coroutine_handle<> h;
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> c)
+    {
+      struct iovec iov;
+      iov.iov_base = (void*)data.data();
+      iov.iov_len = data.size();
+      h = c;
+      if (pcie_dma_write_async(s->dev_, addr, &iov, 1, 0, &on_done, this))
+	std::terminate();
+    }
+
+    int await_resume() const noexcept { return err; }
+
+    static void on_done(int e, void* p)
+    {
+      write_mem_awaiter* const a = static_cast<write_mem_awaiter*>(p);
+      a->err = e;
+      a->h.resume();
+    }
+  };
+
+  write_mem_awaiter write_mem(uint64_t addr, std::span<const uint8_t> data)
+  {
+    return { this, addr, data, 0, {} };
+  }
+
+  /* atomic operations on host memory, T is uint32_t or uint64_t. resumes
+     once the host completes it, other activities run meanwhile.
+     await_resume gives the original value, or std::nullopt on error.
+   */
+
+  template<typename T>
+  struct atomic_awaiter
+  {
+    static_assert(sizeof(T) == 4 || sizeof(T) == 8, "invalid atomic width");
+
+    sched* s;
+    uint8_t op;
+    uint64_t addr;
+    T a;
+    T b;
+    int err;
+    T old;
+    std::coroutine_handle<> h;
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> c)
+    {
+      int x;
+
+      h = c;
+
+      if (op == PCIE_NET_OP_ATOMIC_FETCHADD)
+	x = pcie_atomic_fetch_add_async(s->dev_, addr, sizeof(T), a, &on_done, this);
+      else if (op == PCIE_NET_OP_ATOMIC_SWAP)
+	x = pcie_atomic_swap_async(s->dev_, addr, sizeof(T), a, &on_done, this);
+      else
+	x = pcie_atomic_cas_async(s->dev_, addr, sizeof(T), a, b, &on_done, this);
+
+      if (x) std::terminate();
+    }
+
+    std::optional<T> await_resume() const noexcept
+    {
+      if (err) return {};
+      return old;
+    }
+
+    static void on_done(int e, uint64_t x, void* p)
+    {
+      atomic_awaiter* const w = static_cast<atomic_awaiter*>(p);
+      w->err = e;
+      w->old = (T)x;
+      w->h.resume();
+    }
+  };
+
+  template<typename T>
+  atomic_awaiter<T> fetch_add(uint64_t addr, T x)
+  {
+    return { this, PCIE_NET_OP_ATOMIC_FETCHADD, addr, x, 0, 0, 0, {} };
+  }
+
+  template<typename T>
+  atomic_awaiter<T> swap(uint64_t addr, T x)
+  {
+    return { this, PCIE_NET_OP_ATOMIC_SWAP, addr, x, 0, 0, 0, {} };
+  }
+
+  template<typename T>
+  atomic_awaiter<T> compare_swap(uint64_t addr, T cmp, T x)
+  {
+    return { this, PCIE_NET_OP_ATOMIC_CAS, addr, cmp, x, 0, 0, {} };
+  }
+
+private:
+
+  pcie_dev_t* dev_;
+};
+
+/* event, typically raised by a bar write hook. all the waiters are
+   resumed by set, in the order they started waiting. a coroutine
+   waiting again from its continuation waits for the next set. a set
+   without waiters is latched, the latest value being given to the next
+   one to wait (a register written while the activity is busy).
+ */
+
+template<typename T = uint32_t>
+class event
+{
+public:
+
+  struct awaiter
+  {
+    event* e;
+    T value;
+
+    bool await_ready() noexcept
+    {
+      if (!e->pending_) return false;
+      value = *e->pending_;
+      e->pending_.reset();
+      return true;
+    }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+      e->waiters_.push_back({ h, this });
+    }
+
+    T await_resume() const noexcept { return value; }
+  };
+
+  awaiter operator co_await() { return { this, T() }; }
+
+  void set(const T& x)
+  {
+    if (waiters_.empty())
+    {
+      pending_ = x;
+      return ;
+    }
+
+    std::vector<waiter> w;
+    w.swap(waiters_);
+    for (auto& i : w)
+    {
+      i.a->value = x;
+      i.h.resume();
+    }
+  }
+
+  bool has_waiters() const { return !waiters_.empty(); }
+  bool is_pending() const { return pending_.has_value(); }
+
+private:
+
+  struct waiter
+  {
+    std::coroutine_handle<> h;
+    awaiter* a;
+  };
+
+  std::vector<waiter> waiters_;
+  std::optional<T> pending_;
+};
+
+/* counting credits, for instance descriptors or link buffers. acquire
+   suspends until enough credits are released, waiters served in order.
+ */
+
+class credits
+{
+public:
+
+  explicit credits(size_t n) : count_(n) {}
+
+  struct awaiter
+  {
+    credits* c;
+    size_t n;
+    bool ready;
+
+    bool await_ready() const noexcept { return ready; }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+      c->waiters_.push_back({ h, n });
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  awaiter acquire(size_t n = 1)
+  {
+    /* do not overtake waiters already queued */
+    const bool ready = waiters_.empty() && (count_ >= n);
+    if (ready) count_ -= n;
+    return { this, n, ready };
+  }
+
+  void release(size_t n = 1)
+  {
+    count_ += n;
+
+    while (!waiters_.empty() && (waiters_.front().n <= count_))
+    {
+      const waiter w = waiters_.front();
+      waiters_.pop_front();
+      count_ -= w.n;
+      w.h.resume();
+    }
+  }
+
+  size_t available() const { return count_; }
+
+private:
+
+  struct waiter
+  {
+    std::coroutine_handle<> h;
+    size_t n;
+  };
+
+  size_t count_;
+  std::deque<waiter> waiters_;
+};
+
+} /* namespace vpcie */
+
+
+#endif /* VPCIE_CORO_HPP_INCLUDED */
@@ -48,22 +48,14 @@ static inline uint64_t r(sbone_dev_t* d, uint64_t a)
 {
   /* read register at addr bar1, a */
 
-#if 0 /* 64 bits accesses not supported by qemu */
   return *(const volatile uint64_t*)(d->bar_addrs[1] + a);
-#else
-  return *(const volatile uint32_t*)(d->bar_addrs[1] + a);
-#endif
 }
 
 static inline void w(sbone_dev_t* d, uint64_t a, uint64_t x)
 {
   /* write register at bar1, a */
 
-#if 0 /* 64 bits accesses not supported by qemu */
   *(volatile uint64_t*)(d->bar_addrs[1] + a) = x;
-#else
-  *(volatile uint32_t*)(d->bar_addrs[1] + a) = x;
-#endif
 }
 
 static inline uint64_t e(unsigned int i)